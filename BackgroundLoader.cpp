@@ -0,0 +1,93 @@
+#include <iostream>
+#include <algorithm>
+
+#include "BackgroundLoader.h"
+
+BackgroundLoader::BackgroundLoader(int nb_threads)
+    : mStop(false)
+{
+    if(nb_threads <= 0)
+        nb_threads = std::max(1,int(std::thread::hardware_concurrency()) - 1);
+
+    for(int i=0;i<nb_threads;++i)
+        mThreads.push_back(std::thread(&BackgroundLoader::run,this));
+}
+
+BackgroundLoader::~BackgroundLoader()
+{
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+
+        mStop = true;
+        mQueue.clear();
+    }
+    mCondition.notify_all();
+
+    for(uint32_t i=0;i<mThreads.size();++i)
+        mThreads[i].join();
+}
+
+bool BackgroundLoader::request(Key key,const std::function<void()>& job)
+{
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+
+        if(mStop || !mKeys.insert(key).second)
+            return false;
+
+        mQueue.push_back(std::make_pair(key,job));
+    }
+    mCondition.notify_one();
+
+    return true;
+}
+
+void BackgroundLoader::cancelPending()
+{
+    std::lock_guard<std::mutex> lock(mMutex);
+
+    for(auto it(mQueue.begin());it!=mQueue.end();++it)
+        mKeys.erase(it->first);
+
+    mQueue.clear();
+}
+
+size_t BackgroundLoader::pending() const
+{
+    std::lock_guard<std::mutex> lock(mMutex);
+
+    return mKeys.size();
+}
+
+void BackgroundLoader::run()
+{
+    while(true)
+    {
+        std::pair<Key,std::function<void()> > job;
+
+        {
+            std::unique_lock<std::mutex> lock(mMutex);
+            mCondition.wait(lock,[this]() { return mStop || !mQueue.empty(); });
+
+            if(mStop)
+                return;
+
+            job = mQueue.front();
+            mQueue.pop_front();
+        }
+
+        // A failing job must not take the worker thread down with it.
+
+        try
+        {
+            job.second();
+        }
+        catch(std::exception& e)
+        {
+            std::cerr << "Background loading job failed: " << e.what() << std::endl;
+        }
+
+        std::lock_guard<std::mutex> lock(mMutex);
+        mKeys.erase(job.first);
+    }
+}
@@ -0,0 +1,50 @@
+#pragma once
+
+#include <stdint.h>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include <functional>
+#include <unordered_set>
+#include <condition_variable>
+
+// Pool of worker threads running loading jobs (e.g. decoding and scaling images) in the background.
+//
+// Each job is identified by a key, so that asking several times for the same data only runs one job. Jobs are run in
+// the order they are requested. Queued jobs can be dropped at once with cancelPending(), typically when the view
+// changes and they are not needed anymore. Jobs must store their result themselves (e.g. into an ImageCache).
+// All methods are thread-safe.
+
+class BackgroundLoader
+{
+public:
+    typedef uint64_t Key;
+
+    // nb_threads = 0 uses as many threads as cores, minus one for the GUI thread (and at least one).
+    explicit BackgroundLoader(int nb_threads = 0);
+
+    // Drops the queued jobs, and waits for the running ones to finish.
+    ~BackgroundLoader();
+
+    // Queues job, unless a job with the same key is already queued or running. Returns true if the job was queued.
+    bool request(Key key, const std::function<void()>& job);
+
+    // Drops all jobs that have not started yet.
+    void cancelPending();
+
+    // Number of jobs queued or running.
+    size_t pending() const;
+
+private:
+    void run();
+
+    mutable std::mutex mMutex;
+    std::condition_variable mCondition;
+
+    std::deque<std::pair<Key,std::function<void()> > > mQueue;
+    std::unordered_set<Key> mKeys;		// queued or running jobs
+    std::vector<std::thread> mThreads;
+
+    bool mStop;
+};
@@ -0,0 +1,325 @@
+#include <math.h>
+#include <stddef.h>
+#include <algorithm>
+
+#include "BilinearResample.h"
+
+// No contraction of a*b+c into FMA (GCC does it by default on aarch64, including on NEON intrinsics): the scalar and
+// SIMD paths must round every product and sum alike to stay bit-identical.
+
+#if defined(__clang__)
+#pragma STDC FP_CONTRACT OFF
+#elif defined(__GNUC__)
+#pragma GCC optimize("fp-contract=off")
+#endif
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define BILINEAR_X86
+#include <immintrin.h>
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+#define BILINEAR_NEON
+#include <arm_neon.h>
+#endif
+
+// Source pixels are fetched as 0x..RRGGBB. Only the 3 colour bytes are used afterwards.
+
+struct FetchBGRA
+{
+    uint32_t operator()(const unsigned char *line,int i) const { const unsigned char *p = line + 4*i; return p[0] | (p[1] << 8) | (p[2] << 16); }
+};
+struct FetchBGR
+{
+    uint32_t operator()(const unsigned char *line,int i) const { const unsigned char *p = line + 3*i; return p[0] | (p[1] << 8) | (p[2] << 16); }
+};
+struct FetchIndexed
+{
+    const uint32_t *palette;
+    uint32_t operator()(const unsigned char *line,int i) const { return palette[line[i]]; }
+};
+
+static inline int clampIndex(int i,int max_i) { return i < 0 ? 0 : (i > max_i ? max_i : i); }
+
+// Same expression as in the original per-pixel helpers, evaluated for each of the 3 colour channels.
+
+static inline uint32_t blend(uint32_t c00,uint32_t c10,uint32_t c01,uint32_t c11,float di,float dj)
+{
+    uint32_t res = 0xff000000;
+
+    for(int s=0;s<24;s+=8)
+    {
+        int a = (c00 >> s) & 0xff, b = (c10 >> s) & 0xff;
+        int c = (c01 >> s) & 0xff, d = (c11 >> s) & 0xff;
+
+        int v = (1-di)*((1-dj)*a + dj*c) + di*((1-dj)*b + dj*d);
+
+        res |= uint32_t(v) << s;
+    }
+    return res;
+}
+
+// floor(i) is clamped to [-1,W] before conversion to int, so that far away (or huge) coordinates also end up on the border.
+
+template<class Fetch>
+static void spanScalar(const Fetch& fetch,const unsigned char *line0,const unsigned char *line1,int W,float dj,const float *x,float x_offset,int n,uint32_t *out)
+{
+    for(int k=0;k<n;++k)
+    {
+        float i = x[k] - x_offset;
+        float fi = floorf(i);
+        float di = i - fi;
+        int I = (int)std::min(float(W),std::max(-1.0f,fi));
+
+        int I0 = clampIndex(I,W-1);
+        int I1 = clampIndex(I+1,W-1);
+
+        out[k] = blend(fetch(line0,I0),fetch(line0,I1),fetch(line1,I0),fetch(line1,I1),di,dj);
+    }
+}
+
+#ifdef BILINEAR_X86
+__attribute__((target("sse4.1")))
+static inline __m128i blend4(__m128i c00,__m128i c10,__m128i c01,__m128i c11,__m128 di,__m128 dj)
+{
+    const __m128 one = _mm_set1_ps(1.0f);
+    const __m128i mask = _mm_set1_epi32(0xff);
+
+    __m128 odi = _mm_sub_ps(one,di);
+    __m128 odj = _mm_sub_ps(one,dj);
+    __m128i res = _mm_set1_epi32((int)0xff000000);
+
+    for(int s=0;s<24;s+=8)
+    {
+        __m128 a = _mm_cvtepi32_ps(_mm_and_si128(_mm_srli_epi32(c00,s),mask));
+        __m128 b = _mm_cvtepi32_ps(_mm_and_si128(_mm_srli_epi32(c10,s),mask));
+        __m128 c = _mm_cvtepi32_ps(_mm_and_si128(_mm_srli_epi32(c01,s),mask));
+        __m128 d = _mm_cvtepi32_ps(_mm_and_si128(_mm_srli_epi32(c11,s),mask));
+
+        __m128 v = _mm_add_ps(_mm_mul_ps(odi,_mm_add_ps(_mm_mul_ps(odj,a),_mm_mul_ps(dj,c))),
+                              _mm_mul_ps(di ,_mm_add_ps(_mm_mul_ps(odj,b),_mm_mul_ps(dj,d))));
+
+        res = _mm_or_si128(res,_mm_slli_epi32(_mm_cvttps_epi32(v),s));
+    }
+    return res;
+}
+
+template<class Fetch>
+__attribute__((target("sse4.1")))
+static inline __m128i fetch4(const Fetch& fetch,const unsigned char *line,__m128i I)
+{
+    alignas(16) int idx[4];
+    _mm_store_si128(reinterpret_cast<__m128i*>(idx),I);
+
+    return _mm_setr_epi32(fetch(line,idx[0]),fetch(line,idx[1]),fetch(line,idx[2]),fetch(line,idx[3]));
+}
+
+template<class Fetch>
+__attribute__((target("sse4.1")))
+static void spanSSE41(const Fetch& fetch,const unsigned char *line0,const unsigned char *line1,int W,float dj,const float *x,float x_offset,int n,uint32_t *out)
+{
+    const __m128 off = _mm_set1_ps(x_offset);
+    const __m128 fmin = _mm_set1_ps(-1.0f), fmax = _mm_set1_ps(float(W));
+    const __m128i zero = _mm_setzero_si128(), one = _mm_set1_epi32(1), imax = _mm_set1_epi32(W-1);
+    const __m128 vdj = _mm_set1_ps(dj);
+
+    int k=0;
+
+    for(;k+4<=n;k+=4)
+    {
+        __m128 i = _mm_sub_ps(_mm_loadu_ps(x+k),off);
+        __m128 fi = _mm_floor_ps(i);
+        __m128 di = _mm_sub_ps(i,fi);
+        __m128i I = _mm_cvttps_epi32(_mm_min_ps(fmax,_mm_max_ps(fmin,fi)));
+
+        __m128i I0 = _mm_min_epi32(_mm_max_epi32(I,zero),imax);
+        __m128i I1 = _mm_min_epi32(_mm_max_epi32(_mm_add_epi32(I,one),zero),imax);
+
+        __m128i res = blend4(fetch4(fetch,line0,I0),fetch4(fetch,line0,I1),fetch4(fetch,line1,I0),fetch4(fetch,line1,I1),di,vdj);
+
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(out+k),res);
+    }
+
+    spanScalar(fetch,line0,line1,W,dj,x+k,x_offset,n-k,out+k);
+}
+
+__attribute__((target("avx2")))
+static inline __m256i blend8(__m256i c00,__m256i c10,__m256i c01,__m256i c11,__m256 di,__m256 dj)
+{
+    const __m256 one = _mm256_set1_ps(1.0f);
+    const __m256i mask = _mm256_set1_epi32(0xff);
+
+    __m256 odi = _mm256_sub_ps(one,di);
+    __m256 odj = _mm256_sub_ps(one,dj);
+    __m256i res = _mm256_set1_epi32((int)0xff000000);
+
+    for(int s=0;s<24;s+=8)
+    {
+        __m256 a = _mm256_cvtepi32_ps(_mm256_and_si256(_mm256_srli_epi32(c00,s),mask));
+        __m256 b = _mm256_cvtepi32_ps(_mm256_and_si256(_mm256_srli_epi32(c10,s),mask));
+        __m256 c = _mm256_cvtepi32_ps(_mm256_and_si256(_mm256_srli_epi32(c01,s),mask));
+        __m256 d = _mm256_cvtepi32_ps(_mm256_and_si256(_mm256_srli_epi32(c11,s),mask));
+
+        __m256 v = _mm256_add_ps(_mm256_mul_ps(odi,_mm256_add_ps(_mm256_mul_ps(odj,a),_mm256_mul_ps(dj,c))),
+                                 _mm256_mul_ps(di ,_mm256_add_ps(_mm256_mul_ps(odj,b),_mm256_mul_ps(dj,d))));
+
+        res = _mm256_or_si256(res,_mm256_slli_epi32(_mm256_cvttps_epi32(v),s));
+    }
+    return res;
+}
+
+template<class Fetch>
+__attribute__((target("avx2")))
+static inline __m256i fetch8(const Fetch& fetch,const unsigned char *line,__m256i I)
+{
+    alignas(32) int idx[8];
+    _mm256_store_si256(reinterpret_cast<__m256i*>(idx),I);
+
+    return _mm256_setr_epi32(fetch(line,idx[0]),fetch(line,idx[1]),fetch(line,idx[2]),fetch(line,idx[3]),
+                             fetch(line,idx[4]),fetch(line,idx[5]),fetch(line,idx[6]),fetch(line,idx[7]));
+}
+
+// 32 bits pixels can be gathered directly. The alpha byte is ignored by blend8().
+
+__attribute__((target("avx2")))
+static inline __m256i fetch8(const FetchBGRA&,const unsigned char *line,__m256i I)
+{
+    return _mm256_i32gather_epi32(reinterpret_cast<const int*>(line),I,4);
+}
+
+template<class Fetch>
+__attribute__((target("avx2")))
+static void spanAVX2(const Fetch& fetch,const unsigned char *line0,const unsigned char *line1,int W,float dj,const float *x,float x_offset,int n,uint32_t *out)
+{
+    const __m256 off = _mm256_set1_ps(x_offset);
+    const __m256 fmin = _mm256_set1_ps(-1.0f), fmax = _mm256_set1_ps(float(W));
+    const __m256i zero = _mm256_setzero_si256(), one = _mm256_set1_epi32(1), imax = _mm256_set1_epi32(W-1);
+    const __m256 vdj = _mm256_set1_ps(dj);
+
+    int k=0;
+
+    for(;k+8<=n;k+=8)
+    {
+        __m256 i = _mm256_sub_ps(_mm256_loadu_ps(x+k),off);
+        __m256 fi = _mm256_floor_ps(i);
+        __m256 di = _mm256_sub_ps(i,fi);
+        __m256i I = _mm256_cvttps_epi32(_mm256_min_ps(fmax,_mm256_max_ps(fmin,fi)));
+
+        __m256i I0 = _mm256_min_epi32(_mm256_max_epi32(I,zero),imax);
+        __m256i I1 = _mm256_min_epi32(_mm256_max_epi32(_mm256_add_epi32(I,one),zero),imax);
+
+        __m256i res = blend8(fetch8(fetch,line0,I0),fetch8(fetch,line0,I1),fetch8(fetch,line1,I0),fetch8(fetch,line1,I1),di,vdj);
+
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(out+k),res);
+    }
+
+    spanScalar(fetch,line0,line1,W,dj,x+k,x_offset,n-k,out+k);
+}
+#endif
+
+#ifdef BILINEAR_NEON
+static inline uint32x4_t blend4(uint32x4_t c00,uint32x4_t c10,uint32x4_t c01,uint32x4_t c11,float32x4_t di,float32x4_t dj)
+{
+    const float32x4_t one = vdupq_n_f32(1.0f);
+    const uint32x4_t mask = vdupq_n_u32(0xff);
+
+    float32x4_t odi = vsubq_f32(one,di);
+    float32x4_t odj = vsubq_f32(one,dj);
+    uint32x4_t res = vdupq_n_u32(0xff000000);
+
+    for(int s=0;s<24;s+=8)
+    {
+        int32x4_t rshift = vdupq_n_s32(-s);
+
+        float32x4_t a = vcvtq_f32_u32(vandq_u32(vshlq_u32(c00,rshift),mask));
+        float32x4_t b = vcvtq_f32_u32(vandq_u32(vshlq_u32(c10,rshift),mask));
+        float32x4_t c = vcvtq_f32_u32(vandq_u32(vshlq_u32(c01,rshift),mask));
+        float32x4_t d = vcvtq_f32_u32(vandq_u32(vshlq_u32(c11,rshift),mask));
+
+        float32x4_t v = vaddq_f32(vmulq_f32(odi,vaddq_f32(vmulq_f32(odj,a),vmulq_f32(dj,c))),
+                                  vmulq_f32(di ,vaddq_f32(vmulq_f32(odj,b),vmulq_f32(dj,d))));
+
+        res = vorrq_u32(res,vshlq_u32(vreinterpretq_u32_s32(vcvtq_s32_f32(v)),vdupq_n_s32(s)));
+    }
+    return res;
+}
+
+template<class Fetch>
+static inline uint32x4_t fetch4(const Fetch& fetch,const unsigned char *line,int32x4_t I)
+{
+    int idx[4];
+    vst1q_s32(idx,I);
+
+    const uint32_t c[4] = { fetch(line,idx[0]),fetch(line,idx[1]),fetch(line,idx[2]),fetch(line,idx[3]) };
+    return vld1q_u32(c);
+}
+
+template<class Fetch>
+static void spanNEON(const Fetch& fetch,const unsigned char *line0,const unsigned char *line1,int W,float dj,const float *x,float x_offset,int n,uint32_t *out)
+{
+    const float32x4_t off = vdupq_n_f32(x_offset);
+    const float32x4_t fmin = vdupq_n_f32(-1.0f), fmax = vdupq_n_f32(float(W));
+    const int32x4_t zero = vdupq_n_s32(0), one = vdupq_n_s32(1), imax = vdupq_n_s32(W-1);
+    const float32x4_t vdj = vdupq_n_f32(dj);
+
+    int k=0;
+
+    for(;k+4<=n;k+=4)
+    {
+        float32x4_t i = vsubq_f32(vld1q_f32(x+k),off);
+        float32x4_t fi = vrndmq_f32(i);
+        float32x4_t di = vsubq_f32(i,fi);
+        int32x4_t I = vcvtq_s32_f32(vminq_f32(fmax,vmaxq_f32(fmin,fi)));
+
+        int32x4_t I0 = vminq_s32(vmaxq_s32(I,zero),imax);
+        int32x4_t I1 = vminq_s32(vmaxq_s32(vaddq_s32(I,one),zero),imax);
+
+        vst1q_u32(out+k,blend4(fetch4(fetch,line0,I0),fetch4(fetch,line0,I1),fetch4(fetch,line1,I0),fetch4(fetch,line1,I1),di,vdj));
+    }
+
+    spanScalar(fetch,line0,line1,W,dj,x+k,x_offset,n-k,out+k);
+}
+#endif
+
+template<class Fetch>
+static void span(const Fetch& fetch,const unsigned char *data,int stride,int W,int H,const float *x,float x_offset,float y,int n,uint32_t *out)
+{
+    if(n <= 0 || W <= 0 || H <= 0)
+        return;
+
+    float fj = floorf(y);
+    float dj = y - fj;
+    int J = (int)std::min(float(H),std::max(-1.0f,fj));
+
+    const unsigned char *line0 = data + size_t(stride)*clampIndex(J  ,H-1);
+    const unsigned char *line1 = data + size_t(stride)*clampIndex(J+1,H-1);
+
+#if defined(BILINEAR_X86)
+    static const bool has_avx2  = __builtin_cpu_supports("avx2");
+    static const bool has_sse41 = __builtin_cpu_supports("sse4.1");
+
+    if(has_avx2)
+        return spanAVX2(fetch,line0,line1,W,dj,x,x_offset,n,out);
+    if(has_sse41)
+        return spanSSE41(fetch,line0,line1,W,dj,x,x_offset,n,out);
+#elif defined(BILINEAR_NEON)
+    return spanNEON(fetch,line0,line1,W,dj,x,x_offset,n,out);
+#endif
+    spanScalar(fetch,line0,line1,W,dj,x,x_offset,n,out);
+}
+
+void bilinearSpanBGRA(const unsigned char *data, int stride, int W, int H, const float *x, float x_offset, float y, int n, uint32_t *out)
+{
+    span(FetchBGRA(),data,stride,W,H,x,x_offset,y,n,out);
+}
+
+void bilinearSpanBGR(const unsigned char *data, int stride, int W, int H, const float *x, float x_offset, float y, int n, uint32_t *out)
+{
+    span(FetchBGR(),data,stride,W,H,x,x_offset,y,n,out);
+}
+
+void bilinearSpanIndexed(const unsigned char *data, int stride, const uint32_t *palette, int W, int H, const float *x, float x_offset, float y, int n, uint32_t *out)
+{
+    FetchIndexed fetch;
+    fetch.palette = palette;
+
+    span(fetch,data,stride,W,H,x,x_offset,y,n,out);
+}
@@ -0,0 +1,21 @@
+#pragma once
+
+#include <stdint.h>
+
+// Bilinear resampling of image lines.
+//
+// Each function samples n pixels of line y of a W x H image, at horizontal positions x[k] - x_offset, and writes them
+// as opaque 0xAARRGGBB pixels (i.e. QRgb) into out. Lines of the source image are stride bytes apart. Neighbours that
+// fall outside of the image are clamped to its border, so that no pixel outside of the image is ever read.
+//
+// Pixels are processed 8 (AVX2) or 4 (SSE4.1, NEON) at a time when the CPU supports it, with a scalar fallback. All
+// paths perform the same float operations in the same order, so their results are bit-identical.
+
+// 32 bits pixels, with bytes B,G,R,A in memory (QImage::Format_RGB32/ARGB32 on little endian machines).
+void bilinearSpanBGRA(const unsigned char *data, int stride, int W, int H, const float *x, float x_offset, float y, int n, uint32_t *out);
+
+// 24 bits pixels, with bytes B,G,R in memory (OpenCV colour images).
+void bilinearSpanBGR(const unsigned char *data, int stride, int W, int H, const float *x, float x_offset, float y, int n, uint32_t *out);
+
+// 8 bits palette indices. The palette must have 256 entries.
+void bilinearSpanIndexed(const unsigned char *data, int stride, const uint32_t *palette, int W, int H, const float *x, float x_offset, float y, int n, uint32_t *out);
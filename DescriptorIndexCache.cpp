@@ -0,0 +1,120 @@
+#include <chrono>
+
+#include "DescriptorIndexCache.h"
+
+DescriptorIndexCache::DescriptorIndexCache(size_t max_bytes)
+    : mBytes(0), mMaxBytes(max_bytes), mHits(0), mBuilds(0), mEvictions(0), mBuildSeconds(0.0)
+{
+}
+
+// Each of the randomized KD-trees holds one index per descriptor, and about two 24 bytes nodes per descriptor. The
+// descriptors themselves are not copied.
+
+size_t DescriptorIndexCache::estimatedBytes(const cv::Mat& descriptors)
+{
+    return size_t(NB_TREES) * descriptors.rows * (sizeof(int) + 2*24);
+}
+
+std::shared_ptr<cv::flann::Index> DescriptorIndexCache::index(Key key,const cv::Mat& descriptors)
+{
+    std::promise<std::shared_ptr<cv::flann::Index> > promise;
+    FutureIndex existing;
+
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+
+        auto it = mEntries.find(key);
+
+        if(it != mEntries.end())
+        {
+            ++mHits;
+            mLRU.splice(mLRU.begin(),mLRU,it->second.lru_it);
+
+            existing = it->second.index;
+        }
+        else
+        {
+            Entry e;
+            e.index = promise.get_future().share();
+            e.bytes = estimatedBytes(descriptors);
+
+            mLRU.push_front(key);
+            e.lru_it = mLRU.begin();
+
+            mEntries[key] = e;
+            mBytes += e.bytes;
+            ++mBuilds;
+
+            evict();
+        }
+    }
+
+    if(existing.valid())
+        return existing.get();	// waits if another thread is still building it
+
+    // Built outside of the lock: other indices can be looked up (and built) meanwhile.
+
+    auto start = std::chrono::steady_clock::now();
+    std::shared_ptr<cv::flann::Index> index;
+
+    try
+    {
+        index = std::make_shared<cv::flann::Index>(descriptors,cv::flann::KDTreeIndexParams(NB_TREES));
+    }
+    catch(...)
+    {
+        promise.set_exception(std::current_exception());
+
+        std::lock_guard<std::mutex> lock(mMutex);
+        auto it = mEntries.find(key);
+
+        if(it != mEntries.end())
+        {
+            mBytes -= it->second.bytes;
+            mLRU.erase(it->second.lru_it);
+            mEntries.erase(it);
+        }
+        throw;
+    }
+
+    promise.set_value(index);
+
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+    std::lock_guard<std::mutex> lock(mMutex);
+    mBuildSeconds += elapsed.count();
+
+    return index;
+}
+
+// The entry just added is the most recently used one: it is never evicted, even when it is larger than the budget.
+
+void DescriptorIndexCache::evict()
+{
+    while(mBytes > mMaxBytes && mLRU.size() > 1)
+    {
+        auto it = mEntries.find(mLRU.back());
+
+        mBytes -= it->second.bytes;
+        mLRU.pop_back();
+        mEntries.erase(it);
+
+        ++mEvictions;
+    }
+}
+
+DescriptorIndexCache::Statistics DescriptorIndexCache::statistics() const
+{
+    std::lock_guard<std::mutex> lock(mMutex);
+
+    Statistics s;
+    s.hits          = mHits;
+    s.builds        = mBuilds;
+    s.evictions     = mEvictions;
+    s.build_seconds = mBuildSeconds;
+    s.entries       = mEntries.size();
+    s.bytes         = mBytes;
+    s.max_bytes     = mMaxBytes;
+
+    return s;
+}
@@ -0,0 +1,73 @@
+#pragma once
+
+#include <stdint.h>
+#include <list>
+#include <mutex>
+#include <memory>
+#include <future>
+#include <unordered_map>
+
+#include "opencv2/core/core.hpp"
+#include "opencv2/flann.hpp"
+
+// LRU cache of FLANN indices over the descriptors of images, so that an image is indexed once and then matched against
+// any number of other images.
+//
+// Indices are built on first use, with the same parameters as cv::FlannBasedMatcher. When several threads need the
+// same index, one builds it and the others wait for it. Indices are handed out as shared pointers: evicting an entry
+// never invalidates an index in use. The cache is bounded by an estimate of the index sizes, since FLANN does not
+// report them. Indices point to the descriptors they were built on: these must outlive the cache and the indices handed
+// out. All methods are thread-safe.
+
+class DescriptorIndexCache
+{
+public:
+    typedef uint32_t Key;
+
+    static const size_t DEFAULT_MAX_BYTES = 512*1024*1024;
+    static const int NB_TREES = 4;		// cv::FlannBasedMatcher default
+
+    struct Statistics
+    {
+        uint64_t hits;
+        uint64_t builds;
+        uint64_t evictions;
+        double   build_seconds;
+        size_t   entries;
+        size_t   bytes;
+        size_t   max_bytes;
+    };
+
+    explicit DescriptorIndexCache(size_t max_bytes = DEFAULT_MAX_BYTES);
+
+    // Returns the index of the given descriptors (one per row, CV_32F), building it if needed.
+    std::shared_ptr<cv::flann::Index> index(Key key, const cv::Mat& descriptors);
+
+    Statistics statistics() const;
+
+private:
+    typedef std::shared_future<std::shared_ptr<cv::flann::Index> > FutureIndex;
+
+    struct Entry
+    {
+        FutureIndex index;
+        size_t bytes;
+        std::list<Key>::iterator lru_it;
+    };
+
+    static size_t estimatedBytes(const cv::Mat& descriptors);
+    void evict();	// expects mMutex to be locked
+
+    mutable std::mutex mMutex;
+
+    std::unordered_map<Key,Entry> mEntries;
+    std::list<Key> mLRU;		// most recently used first
+
+    size_t mBytes;
+    size_t mMaxBytes;
+
+    uint64_t mHits;
+    uint64_t mBuilds;
+    uint64_t mEvictions;
+    double   mBuildSeconds;
+};
@@ -0,0 +1,271 @@
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <iostream>
+#include <algorithm>
+
+#include <QDir>
+#include <QFile>
+#include <QSaveFile>
+
+#include "DiskPixelCache.h"
+
+// Each cache file is this header, followed by the scanlines of the image, as laid out in memory by QImage.
+
+static const char ENTRY_MAGIC[8] = { 'I','G','N','P','I','X','E','L' };
+static const uint32_t ENTRY_VERSION = 1;
+
+struct EntryHeader
+{
+    char     magic[8];
+    uint32_t version;
+    uint32_t format;			// QImage::Format
+    uint64_t variant;
+    int64_t  source_mtime;		// nanoseconds
+    int64_t  source_size;
+    int32_t  width;
+    int32_t  height;
+    uint32_t bytes_per_line;
+    uint32_t reserved[3];		// keeps the pixel data aligned on 64 bytes
+};
+
+static_assert(sizeof(EntryHeader) == 64,"Unexpected cache entry header size");
+
+struct MappedEntry
+{
+    void *data;
+    size_t size;
+};
+
+static void unmapEntry(void *info)
+{
+    MappedEntry *e = static_cast<MappedEntry*>(info);
+
+    munmap(e->data,e->size);
+    delete e;
+}
+
+static bool sourceFileStamp(const QString& source,int64_t& mtime,int64_t& size)
+{
+    struct stat st;
+
+    if(stat(QFile::encodeName(source).constData(),&st) != 0)
+        return false;
+
+    mtime = int64_t(st.st_mtim.tv_sec)*1000000000 + st.st_mtim.tv_nsec;
+    size  = st.st_size;
+
+    return true;
+}
+
+DiskPixelCache::DiskPixelCache()
+    : mMaxBytes(0), mBytes(0), mHits(0), mMisses(0), mInvalidations(0), mWrites(0), mEvictions(0)
+{
+}
+
+bool DiskPixelCache::open(const QString& directory,size_t max_bytes)
+{
+    if(max_bytes == 0)
+        return false;
+
+    if(!QDir().mkpath(directory))
+    {
+        std::cerr << "Cannot create pixel cache directory " << directory.toStdString() << ". Pixel cache disabled." << std::endl;
+        return false;
+    }
+
+    std::lock_guard<std::mutex> lock(mMutex);
+
+    mDirectory = directory;
+    mMaxBytes = max_bytes;
+    mBytes = 0;
+
+    QFileInfoList entries = QDir(mDirectory).entryInfoList(QStringList("*.pix"),QDir::Files);
+
+    for(int i=0;i<entries.size();++i)
+        mBytes += entries[i].size();
+
+    evict();
+
+    return true;
+}
+
+// Entries are named after a 64 bits FNV-1a hash of the source path and the variant.
+
+QString DiskPixelCache::entryFilename(const QString& source,uint64_t variant) const
+{
+    QByteArray name = QFile::encodeName(source);
+    uint64_t hash = 0xcbf29ce484222325ull;
+
+    for(int i=0;i<name.size();++i)
+        hash = (hash ^ (unsigned char)name[i]) * 0x100000001b3ull;
+
+    for(int i=0;i<8;++i)
+        hash = (hash ^ ((variant >> (8*i)) & 0xff)) * 0x100000001b3ull;
+
+    return mDirectory + "/" + QString::number(hash,16).rightJustified(16,'0') + ".pix";
+}
+
+void DiskPixelCache::remove(const QString& filename)
+{
+    qint64 size = QFileInfo(filename).size();
+
+    if(!QFile::remove(filename))
+        return;
+
+    std::lock_guard<std::mutex> lock(mMutex);
+
+    mBytes -= std::min(mBytes,size_t(size));
+    ++mInvalidations;
+}
+
+bool DiskPixelCache::find(const QString& source,uint64_t variant,QImage& image)
+{
+    if(!isEnabled())
+        return false;
+
+    QString filename = entryFilename(source,variant);
+    int64_t mtime,size;
+    struct stat st;
+
+    int fd = -1;
+    void *data = MAP_FAILED;
+
+    if(!sourceFileStamp(source,mtime,size) || (fd = ::open(QFile::encodeName(filename).constData(),O_RDONLY)) < 0)
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        ++mMisses;
+        return false;
+    }
+
+    if(fstat(fd,&st) == 0 && st.st_size >= (off_t)sizeof(EntryHeader))
+        data = mmap(NULL,st.st_size,PROT_READ,MAP_PRIVATE,fd,0);
+
+    // The file modification time of the entry is used as its last access time, for eviction.
+
+    if(data != MAP_FAILED)
+        futimens(fd,NULL);
+
+    ::close(fd);	// the mapping stays valid
+
+    const EntryHeader *header = static_cast<const EntryHeader*>(data);
+
+    bool valid = data != MAP_FAILED
+                    && !memcmp(header->magic,ENTRY_MAGIC,sizeof(ENTRY_MAGIC))
+                    && header->version == ENTRY_VERSION
+                    && header->variant == variant
+                    && header->source_mtime == mtime
+                    && header->source_size == size
+                    && header->width > 0 && header->height > 0
+                    && header->format > QImage::Format_Indexed8 && header->format < QImage::NImageFormats
+                    && header->bytes_per_line % 4 == 0
+                    && uint64_t(st.st_size) == sizeof(EntryHeader) + uint64_t(header->bytes_per_line)*header->height;
+
+    if(!valid)
+    {
+        if(data != MAP_FAILED)
+            munmap(data,st.st_size);
+
+        remove(filename);	// outdated (the source file has changed), or not written completely
+
+        std::lock_guard<std::mutex> lock(mMutex);
+        ++mMisses;
+        return false;
+    }
+
+    image = QImage(static_cast<const uchar*>(data) + sizeof(EntryHeader),header->width,header->height,header->bytes_per_line,
+                   QImage::Format(header->format),unmapEntry,new MappedEntry{ data,size_t(st.st_size) });
+
+    std::lock_guard<std::mutex> lock(mMutex);
+    ++mHits;
+
+    return true;
+}
+
+void DiskPixelCache::insert(const QString& source,uint64_t variant,const QImage& image)
+{
+    if(!isEnabled() || image.isNull() || image.colorCount() > 0)
+        return;
+
+    EntryHeader header;
+    memset(&header,0,sizeof(header));
+
+    if(!sourceFileStamp(source,header.source_mtime,header.source_size))
+        return;
+
+    memcpy(header.magic,ENTRY_MAGIC,sizeof(ENTRY_MAGIC));
+    header.version        = ENTRY_VERSION;
+    header.format         = image.format();
+    header.variant        = variant;
+    header.width          = image.width();
+    header.height         = image.height();
+    header.bytes_per_line = image.bytesPerLine();
+
+    // QSaveFile writes to a temporary file, renamed on commit: concurrent readers see either the old entry or the new one.
+
+    QString filename = entryFilename(source,variant);
+    qint64 replaced_size = QFileInfo(filename).size();	// 0 if there is no entry yet
+    QSaveFile file(filename);
+
+    if(!file.open(QIODevice::WriteOnly)
+            || file.write((const char*)&header,sizeof(header)) != sizeof(header)
+            || file.write((const char*)image.constBits(),image.sizeInBytes()) != image.sizeInBytes()
+            || !file.commit())
+    {
+        std::cerr << "Cannot write pixel cache entry " << filename.toStdString() << ": " << file.errorString().toStdString() << std::endl;
+        return;
+    }
+
+    std::lock_guard<std::mutex> lock(mMutex);
+
+    mBytes -= std::min(mBytes,size_t(replaced_size));
+    mBytes += sizeof(header) + image.sizeInBytes();
+    ++mWrites;
+
+    evict();
+}
+
+// Removes the least recently used entries until the cache is 10% under its budget, so that the directory is not
+// listed again on every insertion. Entries in use stay valid, since mapped files survive their removal.
+
+void DiskPixelCache::evict()
+{
+    if(mBytes <= mMaxBytes)
+        return;
+
+    QFileInfoList entries = QDir(mDirectory).entryInfoList(QStringList("*.pix"),QDir::Files,QDir::Time | QDir::Reversed);
+
+    mBytes = 0;
+
+    for(int i=0;i<entries.size();++i)
+        mBytes += entries[i].size();
+
+    for(int i=0;i<entries.size() && mBytes > mMaxBytes - mMaxBytes/10;++i)
+    {
+        size_t size = entries[i].size();
+
+        if(QFile::remove(entries[i].filePath()))
+        {
+            mBytes -= std::min(mBytes,size);
+            ++mEvictions;
+        }
+    }
+}
+
+DiskPixelCache::Statistics DiskPixelCache::statistics() const
+{
+    std::lock_guard<std::mutex> lock(mMutex);
+
+    Statistics s;
+    s.hits          = mHits;
+    s.misses        = mMisses;
+    s.invalidations = mInvalidations;
+    s.writes        = mWrites;
+    s.evictions     = mEvictions;
+    s.bytes         = mBytes;
+    s.max_bytes     = mMaxBytes;
+
+    return s;
+}
@@ -0,0 +1,66 @@
+#pragma once
+
+#include <stdint.h>
+#include <mutex>
+#include <QImage>
+#include <QString>
+
+// Persistent cache of decoded (and possibly scaled) image data, stored as raw pixels in one file per entry.
+//
+// Entries are identified by the path of the source image file, and by a variant number chosen by the caller to tell
+// apart the different pixel data derived from the same file (e.g. the texture level). Each entry records the
+// modification time and size of its source file, and is discarded on lookup when these do not match anymore. Entries
+// are memory mapped when found, so that the returned image costs neither a decode nor a copy: pages are read from disk
+// (or the system page cache) when first accessed. The total size of the cache files is kept under a maximum, by
+// removing the least recently used entries first.
+//
+// The cache is disabled until open() succeeds. All methods are thread-safe.
+
+class DiskPixelCache
+{
+public:
+    static const size_t DEFAULT_MAX_BYTES = size_t(1024)*1024*1024;
+
+    struct Statistics
+    {
+        uint64_t hits;
+        uint64_t misses;
+        uint64_t invalidations;	// entries found outdated or corrupt, and removed
+        uint64_t writes;
+        uint64_t evictions;
+        size_t   bytes;			// total size of the cache files
+        size_t   max_bytes;
+    };
+
+    DiskPixelCache();
+
+    // Uses (and creates if needed) the given directory for the cache files. max_bytes = 0 leaves the cache disabled.
+    bool open(const QString& directory, size_t max_bytes = DEFAULT_MAX_BYTES);
+
+    bool isEnabled() const { return !mDirectory.isNull(); }
+
+    // Looks up the data derived from the given source file. On success, image is a read-only view of the mapped file.
+    bool find(const QString& source, uint64_t variant, QImage& image);
+
+    // Stores image as the data derived from source. Images with a color table are not supported, and ignored.
+    void insert(const QString& source, uint64_t variant, const QImage& image);
+
+    Statistics statistics() const;
+
+private:
+    QString entryFilename(const QString& source, uint64_t variant) const;
+    void remove(const QString& filename);
+    void evict();	// expects mMutex to be locked
+
+    mutable std::mutex mMutex;
+
+    QString mDirectory;
+    size_t mMaxBytes;
+    size_t mBytes;
+
+    uint64_t mHits;
+    uint64_t mMisses;
+    uint64_t mInvalidations;
+    uint64_t mWrites;
+    uint64_t mEvictions;
+};
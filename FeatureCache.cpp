@@ -0,0 +1,226 @@
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <iostream>
+
+#include <QDir>
+#include <QFile>
+#include <QFileInfo>
+#include <QSaveFile>
+
+#include "config.h"
+#include "FeatureCache.h"
+
+// Each sidecar file is this header, followed by the descriptors (one row per keypoint, rows packed) and the keypoints.
+
+static const char SIDECAR_MAGIC[8] = { 'I','G','N','F','E','A','T','S' };
+static const uint32_t SIDECAR_VERSION = 1;
+
+struct SidecarHeader
+{
+    char     magic[8];
+    uint32_t version;
+    uint32_t descriptor_type;		// OpenCV matrix type
+    uint64_t content_hash;
+    FeatureCache::Parameters params;
+    uint32_t nb_keypoints;
+    uint32_t descriptor_cols;
+    uint32_t reserved[3];			// keeps the descriptors aligned on 64 bytes
+};
+
+struct KeypointRecord
+{
+    float   x,y;
+    float   size;
+    float   angle;
+    float   response;
+    int32_t octave;
+    int32_t class_id;
+};
+
+static_assert(sizeof(SidecarHeader) == 64,"Unexpected sidecar header size");
+static_assert(sizeof(KeypointRecord) == 28,"Unexpected keypoint record size");
+
+FeatureCache::FeatureCache(const Parameters& params)
+    : mParams(params), mHits(0), mMisses(0), mWrites(0)
+{
+}
+
+std::string FeatureCache::sidecarFilename(const std::string& image_filename)
+{
+    QFileInfo info(QString::fromStdString(image_filename));
+
+    return (info.absolutePath() + "/" + FEATURE_CACHE_DIRECTORY_NAME + "/" + info.fileName() + ".features").toStdString();
+}
+
+// 64 bits FNV-1a over the mapped file.
+
+bool FeatureCache::contentHash(const std::string& filename,uint64_t& hash)
+{
+    int fd = ::open(filename.c_str(),O_RDONLY);
+
+    if(fd < 0)
+        return false;
+
+    struct stat st;
+    void *data = MAP_FAILED;
+
+    if(fstat(fd,&st) == 0 && st.st_size > 0)
+        data = mmap(NULL,st.st_size,PROT_READ,MAP_PRIVATE,fd,0);
+
+    ::close(fd);
+
+    if(data == MAP_FAILED)
+        return false;
+
+    madvise(data,st.st_size,MADV_SEQUENTIAL);
+
+    const unsigned char *bytes = static_cast<const unsigned char*>(data);
+    hash = 0xcbf29ce484222325ull;
+
+    for(off_t i=0;i<st.st_size;++i)
+        hash = (hash ^ bytes[i]) * 0x100000001b3ull;
+
+    munmap(data,st.st_size);
+
+    return true;
+}
+
+bool FeatureCache::find(const std::string& image_filename,uint64_t content_hash,Features& features)
+{
+    int fd = ::open(sidecarFilename(image_filename).c_str(),O_RDONLY);
+
+    struct stat st;
+    void *data = MAP_FAILED;
+
+    if(fd >= 0)
+    {
+        if(fstat(fd,&st) == 0 && st.st_size >= (off_t)sizeof(SidecarHeader))
+            data = mmap(NULL,st.st_size,PROT_READ,MAP_PRIVATE,fd,0);
+
+        ::close(fd);	// the mapping stays valid
+    }
+
+    const SidecarHeader *header = static_cast<const SidecarHeader*>(data);
+    size_t descriptor_bytes = 0;
+
+    bool valid = data != MAP_FAILED
+                    && !memcmp(header->magic,SIDECAR_MAGIC,sizeof(SIDECAR_MAGIC))
+                    && header->version == SIDECAR_VERSION
+                    && header->content_hash == content_hash
+                    && !memcmp(&header->params,&mParams,sizeof(Parameters))
+                    && (header->descriptor_type == CV_32FC1 || header->descriptor_type == CV_8UC1);
+
+    if(valid)
+    {
+        descriptor_bytes = size_t(header->nb_keypoints) * header->descriptor_cols * CV_ELEM_SIZE(header->descriptor_type);
+        valid = uint64_t(st.st_size) == sizeof(SidecarHeader) + descriptor_bytes + uint64_t(header->nb_keypoints)*sizeof(KeypointRecord);
+    }
+
+    if(!valid)
+    {
+        if(data != MAP_FAILED)
+            munmap(data,st.st_size);
+
+        std::lock_guard<std::mutex> lock(mMutex);
+        ++mMisses;
+        return false;
+    }
+
+    unsigned char *descriptor_data = static_cast<unsigned char*>(data) + sizeof(SidecarHeader);
+    const KeypointRecord *records = reinterpret_cast<const KeypointRecord*>(descriptor_data + descriptor_bytes);
+
+    features.keypoints.resize(header->nb_keypoints);
+
+    for(uint32_t i=0;i<header->nb_keypoints;++i)
+        features.keypoints[i] = cv::KeyPoint(records[i].x,records[i].y,records[i].size,records[i].angle,records[i].response,records[i].octave,records[i].class_id);
+
+    size_t mapped_size = st.st_size;
+    features.mapping = std::shared_ptr<void>(data,[mapped_size](void *p) { munmap(p,mapped_size); });
+
+    if(header->nb_keypoints > 0)
+        features.descriptors = cv::Mat(header->nb_keypoints,header->descriptor_cols,header->descriptor_type,descriptor_data);
+    else
+        features.descriptors = cv::Mat();
+
+    std::lock_guard<std::mutex> lock(mMutex);
+    ++mHits;
+
+    return true;
+}
+
+void FeatureCache::insert(const std::string& image_filename,uint64_t content_hash,const Features& features)
+{
+    const cv::Mat& descriptors(features.descriptors);
+
+    if(!features.keypoints.empty() && (int(features.keypoints.size()) != descriptors.rows || (descriptors.type() != CV_32FC1 && descriptors.type() != CV_8UC1)))
+    {
+        std::cerr << "Unexpected features for " << image_filename << ": not cached." << std::endl;
+        return;
+    }
+
+    SidecarHeader header;
+    memset(&header,0,sizeof(header));
+
+    memcpy(header.magic,SIDECAR_MAGIC,sizeof(SIDECAR_MAGIC));
+    header.version         = SIDECAR_VERSION;
+    header.descriptor_type = features.keypoints.empty() ? CV_32FC1 : descriptors.type();
+    header.content_hash    = content_hash;
+    header.params          = mParams;
+    header.nb_keypoints    = features.keypoints.size();
+    header.descriptor_cols = features.keypoints.empty() ? 0 : descriptors.cols;
+
+    std::vector<KeypointRecord> records(features.keypoints.size());
+
+    for(uint32_t i=0;i<records.size();++i)
+    {
+        const cv::KeyPoint& kp(features.keypoints[i]);
+
+        records[i].x        = kp.pt.x;
+        records[i].y        = kp.pt.y;
+        records[i].size     = kp.size;
+        records[i].angle    = kp.angle;
+        records[i].response = kp.response;
+        records[i].octave   = kp.octave;
+        records[i].class_id = kp.class_id;
+    }
+
+    // QSaveFile writes to a temporary file, renamed on commit: concurrent readers see either the old file or the new one.
+
+    QString filename = QString::fromStdString(sidecarFilename(image_filename));
+    QDir().mkpath(QFileInfo(filename).absolutePath());
+
+    QSaveFile file(filename);
+    bool ok = file.open(QIODevice::WriteOnly) && file.write((const char*)&header,sizeof(header)) == sizeof(header);
+
+    for(uint32_t i=0;ok && i<header.nb_keypoints;++i)
+    {
+        qint64 row_bytes = descriptors.cols * descriptors.elemSize();
+        ok = file.write((const char*)descriptors.ptr(i),row_bytes) == row_bytes;
+    }
+
+    qint64 records_bytes = records.size()*sizeof(KeypointRecord);
+
+    if(!ok || file.write((const char*)records.data(),records_bytes) != records_bytes || !file.commit())
+    {
+        std::cerr << "Cannot write features sidecar file " << filename.toStdString() << ": " << file.errorString().toStdString() << std::endl;
+        return;
+    }
+
+    std::lock_guard<std::mutex> lock(mMutex);
+    ++mWrites;
+}
+
+FeatureCache::Statistics FeatureCache::statistics() const
+{
+    std::lock_guard<std::mutex> lock(mMutex);
+
+    Statistics s;
+    s.hits   = mHits;
+    s.misses = mMisses;
+    s.writes = mWrites;
+
+    return s;
+}
@@ -0,0 +1,69 @@
+#pragma once
+
+#include <stdint.h>
+#include <mutex>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "opencv2/core/core.hpp"
+
+// Persistent cache of the keypoints and descriptors computed for registration, stored in a binary sidecar file per image.
+//
+// Sidecar files go in a hidden directory next to the image (see FEATURE_CACHE_DIRECTORY_NAME), named after the image.
+// Each one records a hash of the image file content and the detector parameters it was computed with, and is ignored
+// (then overwritten) when either does not match anymore. Sidecar files are memory mapped on load: descriptors are used
+// in place, without being read nor copied upfront.
+//
+// All methods are thread-safe.
+
+class FeatureCache
+{
+public:
+    // Detector parameters. Features computed with different parameters are never mixed.
+    struct Parameters
+    {
+        int32_t min_hessian;
+        int32_t n_octaves;
+        int32_t n_octave_layers;
+        int32_t extended;
+        int32_t upright;
+    };
+
+    struct Features
+    {
+        std::vector<cv::KeyPoint> keypoints;
+        cv::Mat descriptors;				// one row per keypoint. May point into the mapped sidecar file, read-only.
+        std::shared_ptr<void> mapping;		// keeps the sidecar file mapped while descriptors are in use
+    };
+
+    struct Statistics
+    {
+        uint64_t hits;
+        uint64_t misses;		// sidecar file missing, outdated or corrupt
+        uint64_t writes;
+    };
+
+    explicit FeatureCache(const Parameters& params);
+
+    // 64 bits hash of the content of the given file. Returns false if the file cannot be read.
+    static bool contentHash(const std::string& filename, uint64_t& hash);
+
+    // Looks up the features of the given image, which content hash is content_hash.
+    bool find(const std::string& image_filename, uint64_t content_hash, Features& features);
+
+    // Stores the features of the given image, replacing any previous sidecar file.
+    void insert(const std::string& image_filename, uint64_t content_hash, const Features& features);
+
+    Statistics statistics() const;
+
+private:
+    static std::string sidecarFilename(const std::string& image_filename);
+
+    Parameters mParams;
+
+    mutable std::mutex mMutex;
+    uint64_t mHits;
+    uint64_t mMisses;
+    uint64_t mWrites;
+};
@@ -7,14 +7,28 @@
 #include "ScreenshotCollectionMapDB.h"
 #include "QctMapDB.h"
 #include "MapAccessor.h"
+#include "TextureManager.h"
+#include "MapRegistration.h"
 
 int main(int argc,char *argv[])
 {
     argstream as(argc,argv);
 
     std::string qct_file;
+    int tile_cache_mb = QctTileCache::DEFAULT_MAX_BYTES/(1024*1024);
+    int image_cache_mb = ImageCache::DEFAULT_MAX_BYTES/(1024*1024);
+    int disk_cache_mb = DiskPixelCache::DEFAULT_MAX_BYTES/(1024*1024);
+    int texture_memory_mb = TextureManager::DEFAULT_MAX_BYTES/(1024*1024);
+    int registration_candidates = MapRegistration::DEFAULT_CANDIDATES_PER_IMAGE;
+    bool registration_recall = false;
 
     as >> parameter('q',"qct",qct_file,"Qct IGN file",false)
+       >> parameter('c',"tile-cache",tile_cache_mb,"Size of the decoded Qct tiles cache (MB)",false)
+       >> parameter('i',"image-cache",image_cache_mb,"Size of the decoded images and texture data cache (MB)",false)
+       >> parameter('d',"disk-cache",disk_cache_mb,"Size of the decoded texture data cache on disk, next to the map file (MB). 0 disables it",false)
+       >> parameter('t',"texture-memory",texture_memory_mb,"Graphics card memory used for textures (MB)",false)
+       >> parameter('k',"registration-candidates",registration_candidates,"Number of images matched with each image when computing all positions. 0 matches all pairs",false)
+       >> option('r',"registration-recall",registration_recall,"Match all pairs when computing all positions, and report how many image neighbours the candidates would have found")
        >> help();
 
     as.defaultErrorHandling();
@@ -23,14 +37,16 @@ int main(int argc,char *argv[])
 	QApplication IGNMapperApp(argc,argv);
 
 	MapGUIWindow map_gui_win;
+	map_gui_win.setTextureMemory(size_t(texture_memory_mb)*1024*1024);
+	map_gui_win.setRegistrationCandidates(registration_candidates,registration_recall);
 	map_gui_win.show();
 
     // now create the map
 
     if(!qct_file.empty())
     {
-        QctMapDB mapdb(QString::fromStdString(qct_file)) ;
-        MapAccessor ma(mapdb) ;
+        QctMapDB mapdb(QString::fromStdString(qct_file),size_t(tile_cache_mb)*1024*1024) ;
+        MapAccessor ma(mapdb,size_t(image_cache_mb)*1024*1024) ;
         map_gui_win.setMapAccessor(ma);
 
         return IGNMapperApp.exec();
@@ -38,7 +54,7 @@ int main(int argc,char *argv[])
     else
     {
         ScreenshotCollectionMapDB mapdb(MAP_ROOT_DIRECTORY) ;
-        MapAccessor ma(mapdb) ;
+        MapAccessor ma(mapdb,size_t(image_cache_mb)*1024*1024,size_t(disk_cache_mb)*1024*1024) ;
         map_gui_win.setMapAccessor(ma);
 
         return IGNMapperApp.exec();
@@ -10,22 +10,46 @@ SOURCES = IGNMapper.cpp \
         ScreenshotCollectionMapDB.cpp \
         MapDB.cpp \
         MapAccessor.cpp \
+        ImageSpatialIndex.cpp \
+        ImageCache.cpp \
+        DiskPixelCache.cpp \
+        BackgroundLoader.cpp \
         MapGUIWindow.cpp \
         MapViewer.cpp \
+        TextureAtlas.cpp \
+        TextureManager.cpp \
         QctFile.cpp \
+        QctReader.cpp \
+        QctTileCache.cpp \
         MapExporter.cpp \
         MapRegistration.cpp \
+        FeatureCache.cpp \
+        DescriptorIndexCache.cpp \
+        PaletteExpand.cpp \
+        BilinearResample.cpp \
         QctMapDB.cpp
 
 HEADERS = MapDB.h \
         MapAccessor.h \
+        ImageSpatialIndex.h \
+        ImageCache.h \
+        DiskPixelCache.h \
+        BackgroundLoader.h \
         MapGUIWindow.h \
         ScreenshotCollectionMapDB.h \
         MapViewer.h \
+        TextureAtlas.h \
+        TextureManager.h \
         config.h \
         QctFile.h \
+        QctReader.h \
+        QctTileCache.h \
         MapExporter.h \
         MapRegistration.h \
+        FeatureCache.h \
+        DescriptorIndexCache.h \
+        PaletteExpand.h \
+        BilinearResample.h \
         QctMapDB.h
 
 INCLUDEPATH += /usr/include/opencv4
@@ -0,0 +1,164 @@
+#include "ImageCache.h"
+
+ImageCache::ImageCache(size_t max_bytes)
+    : mMaxBytes(max_bytes), mBytes(0), mPinned(0), mHits(0), mMisses(0), mEvictions(0)
+{
+}
+
+// Pinned entries are taken out of the LRU list, so that eviction never needs to skip them.
+
+void ImageCache::pin(Entry& e)
+{
+    if(e.pins++ == 0)
+    {
+        mLRU.erase(e.lru_it);
+        ++mPinned;
+    }
+}
+
+bool ImageCache::find(Key key, QImage& image, bool pin)
+{
+    std::lock_guard<std::mutex> lock(mMutex);
+
+    auto it = mEntries.find(key);
+
+    if(it == mEntries.end())
+    {
+        ++mMisses;
+        return false;
+    }
+
+    Entry& e(it->second);
+
+    if(pin)
+        this->pin(e);
+    else if(e.pins == 0)
+        mLRU.splice(mLRU.begin(),mLRU,e.lru_it);	// move to front. Iterators stay valid.
+
+    image = e.image;
+    ++mHits;
+
+    return true;
+}
+
+bool ImageCache::peek(Key key, QImage& image) const
+{
+    std::lock_guard<std::mutex> lock(mMutex);
+
+    auto it = mEntries.find(key);
+
+    if(it == mEntries.end())
+        return false;
+
+    image = it->second.image;
+    return true;
+}
+
+void ImageCache::insert(Key key, QImage& image, bool pin)
+{
+    std::lock_guard<std::mutex> lock(mMutex);
+
+    auto res = mEntries.insert(std::make_pair(key,Entry()));
+    Entry& e(res.first->second);
+
+    if(!res.second)		// another thread loaded the same image in the meantime
+    {
+        image = e.image;
+
+        if(pin)
+            this->pin(e);
+        else if(e.pins == 0)
+            mLRU.splice(mLRU.begin(),mLRU,e.lru_it);
+
+        return;
+    }
+
+    mLRU.push_front(key);
+
+    e.image  = image;
+    e.bytes  = image.sizeInBytes();
+    e.pins   = 0;
+    e.lru_it = mLRU.begin();
+
+    mBytes += e.bytes;
+
+    if(pin)
+        this->pin(e);
+
+    evict();
+}
+
+void ImageCache::unpin(Key key)
+{
+    std::lock_guard<std::mutex> lock(mMutex);
+
+    auto it = mEntries.find(key);
+
+    if(it == mEntries.end() || it->second.pins == 0)
+        return;
+
+    Entry& e(it->second);
+
+    if(--e.pins == 0)
+    {
+        mLRU.push_front(key);
+        e.lru_it = mLRU.begin();
+        --mPinned;
+
+        evict();
+    }
+}
+
+// The most recently used unpinned entry is never evicted, even when pinned entries alone exceed the budget: otherwise
+// an image would be dropped as soon as it is inserted, and decoded again on every access.
+
+void ImageCache::evict()
+{
+    while(mBytes > mMaxBytes && mLRU.size() > 1)
+    {
+        auto it = mEntries.find(mLRU.back());
+
+        mBytes -= it->second.bytes;
+        mEntries.erase(it);
+        mLRU.pop_back();
+        ++mEvictions;
+    }
+}
+
+void ImageCache::setMaxBytes(size_t max_bytes)
+{
+    std::lock_guard<std::mutex> lock(mMutex);
+
+    mMaxBytes = max_bytes;
+    evict();
+}
+
+void ImageCache::clear()
+{
+    std::lock_guard<std::mutex> lock(mMutex);
+
+    for(auto it(mLRU.begin());it!=mLRU.end();++it)
+    {
+        auto eit = mEntries.find(*it);
+
+        mBytes -= eit->second.bytes;
+        mEntries.erase(eit);
+    }
+    mLRU.clear();
+}
+
+ImageCache::Statistics ImageCache::statistics() const
+{
+    std::lock_guard<std::mutex> lock(mMutex);
+
+    Statistics s;
+    s.hits      = mHits;
+    s.misses    = mMisses;
+    s.evictions = mEvictions;
+    s.entries   = mEntries.size();
+    s.pinned    = mPinned;
+    s.bytes     = mBytes;
+    s.max_bytes = mMaxBytes;
+
+    return s;
+}
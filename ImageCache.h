@@ -0,0 +1,82 @@
+#pragma once
+
+#include <stdint.h>
+#include <list>
+#include <mutex>
+#include <unordered_map>
+#include <QImage>
+
+// LRU cache of images, bounded by the total size of their pixel data.
+//
+// Images are handed out as implicitly shared QImage, so that evicting an entry never invalidates a copy held by a
+// caller. Entries can additionally be pinned while in use (e.g. by the frame being drawn, or the tile being exported):
+// pinned entries are never evicted, even when the cache is over budget, so that they are not decoded again on the
+// next access. They become candidates for eviction again when their last pin is released. All methods are thread-safe.
+
+class ImageCache
+{
+public:
+    typedef uint64_t Key;
+
+    static const size_t DEFAULT_MAX_BYTES = 256*1024*1024;
+
+    struct Statistics
+    {
+        uint64_t hits;
+        uint64_t misses;
+        uint64_t evictions;
+        size_t   entries;
+        size_t   pinned;		// number of pinned entries
+        size_t   bytes;		// size of the cached pixel data, pinned entries included
+        size_t   max_bytes;
+    };
+
+    explicit ImageCache(size_t max_bytes = DEFAULT_MAX_BYTES);
+
+    // Looks up image "key". On success the image becomes the most recently used one, and is pinned once if pin is true.
+    bool find(Key key, QImage& image, bool pin = false);
+
+    // Same as find(), without pinning, and without changing the LRU order or the statistics. Meant for opportunistic
+    // lookups, e.g. of data an image could be computed from.
+    bool peek(Key key, QImage& image) const;
+
+    // Adds an image, then evicts the least recently used unpinned images until the cache fits in its budget, always
+    // keeping the one just added. If another thread inserted the same key in the meantime, the cached image is kept and
+    // returned in image.
+    void insert(Key key, QImage& image, bool pin = false);
+
+    // Pins are counted: an entry pinned n times must be unpinned n times.
+    void unpin(Key key);
+
+    void setMaxBytes(size_t max_bytes);
+    void clear();	// removes all unpinned entries
+
+    Statistics statistics() const;
+
+private:
+    typedef std::list<Key> KeyList;	// unpinned entries, most recently used first
+
+    struct Entry
+    {
+        QImage image;
+        size_t bytes;
+        int pins;
+        KeyList::iterator lru_it;	// only valid when pins == 0
+    };
+
+    void pin(Entry& e);
+    void evict();	// expects mMutex to be locked
+
+    mutable std::mutex mMutex;
+
+    std::unordered_map<Key,Entry> mEntries;
+    KeyList mLRU;
+
+    size_t mMaxBytes;
+    size_t mBytes;
+    size_t mPinned;
+
+    uint64_t mHits;
+    uint64_t mMisses;
+    uint64_t mEvictions;
+};
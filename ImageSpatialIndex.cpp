@@ -0,0 +1,187 @@
+#include <math.h>
+#include <algorithm>
+
+#include "ImageSpatialIndex.h"
+
+void ImageSpatialIndex::build(const std::map<MapDB::ImageHandle,MapDB::RegisteredImage>& images)
+{
+    mCells.clear();
+    mRects.clear();
+    mMinCX = mMinCY = 0;
+    mMaxCX = mMaxCY = -1;
+
+    // Cells of the size of an average image keep the number of images per cell, and cells per image, low.
+
+    double total_size = 0.0;
+
+    for(auto it(images.begin());it!=images.end();++it)
+        total_size += std::max(it->second.W,it->second.H);
+
+    mCellSize = images.empty() ? 1.0f : std::max(1.0f,float(total_size / images.size()));
+
+    for(auto it(images.begin());it!=images.end();++it)
+        update(it->first,it->second);
+}
+
+void ImageSpatialIndex::cellRange(const Rect& r,int& cx0,int& cy0,int& cx1,int& cy1) const
+{
+    // Image rectangles are half-open: [x,x+W) x [y,y+H)
+
+    cx0 = cellCoord(r.x);
+    cy0 = cellCoord(r.y);
+    cx1 = std::max(cx0,(int)ceilf((r.x + r.W) / mCellSize) - 1);
+    cy1 = std::max(cy0,(int)ceilf((r.y + r.H) / mCellSize) - 1);
+}
+
+void ImageSpatialIndex::update(MapDB::ImageHandle h,const MapDB::RegisteredImage& img)
+{
+    Rect r;
+    r.x = img.bottom_left_corner.x;
+    r.y = img.bottom_left_corner.y;
+    r.W = img.W;
+    r.H = img.H;
+
+    remove(h);
+    insert(h,r);
+}
+
+void ImageSpatialIndex::insert(MapDB::ImageHandle h,const Rect& r)
+{
+    int cx0,cy0,cx1,cy1;
+    cellRange(r,cx0,cy0,cx1,cy1);
+
+    for(int cx=cx0;cx<=cx1;++cx)
+        for(int cy=cy0;cy<=cy1;++cy)
+            mCells[cellKey(cx,cy)].push_back(CellEntry{h,r});
+
+    if(mMaxCX < mMinCX)	// first image
+    {
+        mMinCX = cx0; mMaxCX = cx1;
+        mMinCY = cy0; mMaxCY = cy1;
+    }
+    else
+    {
+        mMinCX = std::min(mMinCX,cx0); mMaxCX = std::max(mMaxCX,cx1);
+        mMinCY = std::min(mMinCY,cy0); mMaxCY = std::max(mMaxCY,cy1);
+    }
+
+    mRects[h] = r;
+}
+
+void ImageSpatialIndex::remove(MapDB::ImageHandle h)
+{
+    auto it = mRects.find(h);
+
+    if(it == mRects.end())
+        return;
+
+    int cx0,cy0,cx1,cy1;
+    cellRange(it->second,cx0,cy0,cx1,cy1);
+
+    for(int cx=cx0;cx<=cx1;++cx)
+        for(int cy=cy0;cy<=cy1;++cy)
+        {
+            auto cit = mCells.find(cellKey(cx,cy));
+
+            if(cit == mCells.end())
+                continue;
+
+            std::vector<CellEntry>& v(cit->second);
+            v.erase(std::remove_if(v.begin(),v.end(),[h](const CellEntry& e) { return e.handle == h; }),v.end());
+
+            if(v.empty())
+                mCells.erase(cit);
+        }
+
+    // The occupied cells bounds are not shrunk: they are only used to clip queries.
+
+    mRects.erase(it);
+}
+
+void ImageSpatialIndex::query(const MapDB::ImageSpaceCoord& c1,const MapDB::ImageSpaceCoord& c2,std::vector<MapDB::ImageHandle>& result) const
+{
+    result.clear();
+
+    float xmin = std::min(c1.x,c2.x), xmax = std::max(c1.x,c2.x);
+    float ymin = std::min(c1.y,c2.y), ymax = std::max(c1.y,c2.y);
+
+    int cx0 = std::max(mMinCX,cellCoord(xmin)), cx1 = std::min(mMaxCX,cellCoord(xmax));
+    int cy0 = std::max(mMinCY,cellCoord(ymin)), cy1 = std::min(mMaxCY,cellCoord(ymax));
+
+    if(cx0 > cx1 || cy0 > cy1)
+        return;
+
+    // When the area covers more cells than there are, walking the cells themselves is cheaper.
+
+    bool scan_cells = double(cx1-cx0+1)*(cy1-cy0+1) > mCells.size();
+
+    auto collect = [&](const std::vector<CellEntry>& v)
+    {
+        for(uint32_t i=0;i<v.size();++i)
+        {
+            const Rect& r(v[i].rect);
+
+            if(r.x <= xmax && r.x + r.W >= xmin && r.y <= ymax && r.y + r.H >= ymin)
+                result.push_back(v[i].handle);
+        }
+    };
+
+    if(scan_cells)
+    {
+        for(auto it(mCells.begin());it!=mCells.end();++it)
+        {
+            int cx = int(uint32_t(it->first >> 32));
+            int cy = int(uint32_t(it->first));
+
+            if(cx >= cx0 && cx <= cx1 && cy >= cy0 && cy <= cy1)
+                collect(it->second);
+        }
+    }
+    else
+        for(int cx=cx0;cx<=cx1;++cx)
+            for(int cy=cy0;cy<=cy1;++cy)
+            {
+                auto it = mCells.find(cellKey(cx,cy));
+
+                if(it != mCells.end())
+                    collect(it->second);
+            }
+
+    // images spanning several cells are found more than once
+
+    std::sort(result.begin(),result.end());
+    result.erase(std::unique(result.begin(),result.end()),result.end());
+}
+
+void ImageSpatialIndex::queryPoint(const MapDB::ImageSpaceCoord& p,std::vector<MapDB::ImageHandle>& result) const
+{
+    result.clear();
+
+    auto it = mCells.find(cellKey(cellCoord(p.x),cellCoord(p.y)));
+
+    if(it == mCells.end())
+        return;
+
+    const std::vector<CellEntry>& v(it->second);
+
+    for(uint32_t i=0;i<v.size();++i)
+    {
+        const Rect& r(v[i].rect);
+
+        if(r.x <= p.x && r.x + r.W > p.x && r.y <= p.y && r.y + r.H > p.y)
+            result.push_back(v[i].handle);
+    }
+
+    std::sort(result.begin(),result.end(),[](MapDB::ImageHandle a,MapDB::ImageHandle b) { return uint32_t(a) > uint32_t(b); });
+}
+
+bool ImageSpatialIndex::getRect(MapDB::ImageHandle h,Rect& r) const
+{
+    auto it = mRects.find(h);
+
+    if(it == mRects.end())
+        return false;
+
+    r = it->second;
+    return true;
+}
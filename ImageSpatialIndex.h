@@ -0,0 +1,68 @@
+#pragma once
+
+#include <math.h>
+#include <map>
+#include <algorithm>
+#include <vector>
+#include <unordered_map>
+
+#include "MapDB.h"
+
+// Spatial index over the rectangles of the registered images of a MapDB.
+//
+// Images are stored in a sparse uniform grid, which cell size is the average image size. Each image is referenced
+// in all cells its rectangle overlaps. Queries only visit the cells that intersect the requested area, so that their
+// cost depends on the number of images found rather than on the total number of images. Images can be moved
+// individually with update().
+//
+// Query methods are const and can be called concurrently.
+
+class ImageSpatialIndex
+{
+public:
+    struct Rect
+    {
+        float x,y;	// bottom left corner
+        int W,H;
+    };
+
+    ImageSpatialIndex() : mCellSize(1.0f),mMinCX(0),mMinCY(0),mMaxCX(-1),mMaxCY(-1) {}
+
+    // Rebuilds the index from scratch. The cell size is computed from the images sizes.
+    void build(const std::map<MapDB::ImageHandle,MapDB::RegisteredImage>& images);
+
+    // Inserts image h, or moves it if it is already known.
+    void update(MapDB::ImageHandle h,const MapDB::RegisteredImage& img);
+
+    // Returns the images that intersect the rectangle with the given corners (in any order), by increasing handle.
+    void query(const MapDB::ImageSpaceCoord& c1,const MapDB::ImageSpaceCoord& c2,std::vector<MapDB::ImageHandle>& result) const;
+
+    // Returns the images that contain point p, by decreasing handle (i.e. the image drawn last comes first).
+    void queryPoint(const MapDB::ImageSpaceCoord& p,std::vector<MapDB::ImageHandle>& result) const;
+
+    bool getRect(MapDB::ImageHandle h,Rect& r) const;
+
+    size_t size() const { return mRects.size(); }
+
+private:
+    typedef uint64_t CellKey;
+
+    struct CellEntry	// images rectangles are duplicated in cells, so that queries do not need another lookup
+    {
+        MapDB::ImageHandle handle;
+        Rect rect;
+    };
+
+    CellKey cellKey(int cx,int cy) const { return (uint64_t(uint32_t(cx)) << 32) | uint32_t(cy); }
+    int cellCoord(float x) const { return (int)std::max(-1e9f,std::min(1e9f,floorf(x / mCellSize))); }
+    void cellRange(const Rect& r,int& cx0,int& cy0,int& cx1,int& cy1) const;
+
+    void insert(MapDB::ImageHandle h,const Rect& r);
+    void remove(MapDB::ImageHandle h);
+
+    float mCellSize;
+    int mMinCX,mMinCY,mMaxCX,mMaxCY;	// bounds of the non empty cells
+
+    std::unordered_map<CellKey,std::vector<CellEntry> > mCells;
+    std::unordered_map<uint32_t,Rect> mRects;
+};
@@ -1,33 +1,103 @@
 #include <math.h>
 #include <iostream>
+#include <algorithm>
+#include <unordered_map>
+#include <string.h>
 #include <QImage>
+#include <QFileInfo>
+#include <QDateTime>
 
+#include "config.h"
 #include "MapAccessor.h"
+#include "PaletteExpand.h"
 #include "ScreenshotCollectionMapDB.h"
 
 #define CHECK_MMA auto mDb2 = dynamic_cast<ScreenshotCollectionMapDB*>(&mDb); if(!mDb2) return
 
-MapAccessor::MapAccessor(MapDB& m) : mDb(m)
+MapAccessor::MapAccessor(MapDB& m,size_t cache_size,size_t disk_cache_size)
+    : mDb(m),mCache(cache_size),mDiskCacheMaskStamp(0)
 {
+    mSpatialIndex.build(mDb.getFullListOfImages());
+
     CHECK_MMA;
 
     if(!mDb2->imagesMaskFilename().isNull())
-        mImageMask = QImage(mDb2->rootDirectory() + "/" + mDb2->imagesMaskFilename());//.createAlphaMask(Qt::AutoColor);
+    {
+        QString mask_filename = mDb2->rootDirectory() + "/" + mDb2->imagesMaskFilename();
+
+        mImageMask = QImage(mask_filename);//.createAlphaMask(Qt::AutoColor);
+
+        // Changing the mask changes the textures, hence the disk cache entries to look for.
+
+        mDiskCacheMaskStamp = uint64_t(QFileInfo(mask_filename).lastModified().toMSecsSinceEpoch()) & 0x00ffffffffffffffull;
+    }
+
+    mDiskCache.open(mDb2->rootDirectory() + "/" + PIXEL_CACHE_DIRECTORY_NAME,disk_cache_size);
+}
+
+MapAccessor::~MapAccessor()
+{
+    ImageCache::Statistics s = mCache.statistics();
+
+    std::cerr << "Image cache: " << s.hits << " hits, " << s.misses << " misses, " << s.evictions << " evictions. "
+              << s.entries << " images in cache, " << s.pinned << " pinned (" << s.bytes/1024 << " KB out of " << s.max_bytes/1024 << " KB)" << std::endl;
+
+    if(mDiskCache.isEnabled())
+    {
+        DiskPixelCache::Statistics d = mDiskCache.statistics();
+
+        std::cerr << "Pixel disk cache: " << d.hits << " hits, " << d.misses << " misses (" << d.invalidations << " outdated), " << d.writes << " writes, "
+                  << d.evictions << " evictions (" << d.bytes/1024 << " KB out of " << d.max_bytes/1024 << " KB)" << std::endl;
+    }
 }
 
 
-void MapAccessor::getImagesToDraw(const MapDB::ImageSpaceCoord& mBottomLeftViewCorner, const MapDB::ImageSpaceCoord& mTopRightViewCorner, std::vector<ImageData> &images_to_draw) const
+// Returns the number of times the image can be halved while staying larger than its on-screen size. The image is halved
+// further when needed to fit in max_texture_size (when not 0).
+
+static int textureLevel(int W,int H,float view_pixel_size,int max_texture_size)
+{
+    int level = 0;
+
+    if(view_pixel_size > 0.0f)
+        while(std::max(W >> (level+1), H >> (level+1)) >= std::max(W,H) / view_pixel_size && (W >> (level+1)) > 0 && (H >> (level+1)) > 0)
+            ++level;
+
+    if(max_texture_size > 0)
+        while(std::max(W >> level, H >> level) > max_texture_size)
+            ++level;
+
+    return level;
+}
+
+void MapAccessor::getImagesToDraw(const MapDB::ImageSpaceCoord& mBottomLeftViewCorner, const MapDB::ImageSpaceCoord& mTopRightViewCorner, std::vector<ImageData> &images_to_draw,float view_pixel_size,bool wait_for_textures,int max_texture_size) const
 {
-    // For now, just dont be subtle: return all known images.
-    // To do:
-    //	* only return the images that actually cross the supplied rectangle of coordinates
-    //	* add a cache and load images n demand from the disk
+    // Textures of the previous frame stay pinned until the new ones are, so that those still visible are not evicted in between.
+
+    std::vector<ImageCache::Key> previous_pins;
+    previous_pins.swap(mFramePins);
+
+    // Textures requested for a previous view, and not started yet, are not needed anymore. Those still visible are
+    // requested again below, in drawing order.
+
+    if(!wait_for_textures)
+        mLoader.cancelPending();
+
+    // Only return the images that cross the supplied rectangle of coordinates, in the same order as the DB.
 
     const std::map<MapDB::ImageHandle,MapDB::RegisteredImage>& images_map = mDb.getFullListOfImages();
     images_to_draw.clear();
 
- 	for(auto it(images_map.begin());it!=images_map.end();++it)
+    std::vector<MapDB::ImageHandle> handles;
+    mSpatialIndex.query(mBottomLeftViewCorner,mTopRightViewCorner,handles);
+
+ 	for(uint32_t i=0;i<handles.size();++i)
     {
+        auto it = images_map.find(handles[i]);
+
+        if(it == images_map.end())
+            continue;
+
         ImageData id ;
 
         id.W                  = it->second.W;
@@ -37,12 +107,14 @@ void MapAccessor::getImagesToDraw(const MapDB::ImageSpaceCoord& mBottomLeftViewC
         //id.directory        = mDb.rootDirectory() ;
         //id.filename         = it->first ;
 
-        int tmp_W,tmp_H;
-        id.texture_data       = getPixelDataForTextureUsage(it->first,tmp_W,tmp_H);
+        id.texture_data       = getPixelDataForTextureUsage(it->first,textureLevel(id.W,id.H,view_pixel_size,max_texture_size),wait_for_textures,id.texture_W,id.texture_H);
         id.descriptors        = it->second.descriptors;
 
         images_to_draw.push_back(id);
     }
+
+    for(uint32_t i=0;i<previous_pins.size();++i)
+        mCache.unpin(previous_pins[i]);
 }
 
 bool MapAccessor::getImageParams(MapDB::ImageHandle h, MapDB::RegisteredImage& img)
@@ -55,112 +127,380 @@ QImage MapAccessor::getImageData(MapDB::ImageHandle h) const
     return mDb.getImageData(h);
 }
 
-bool MapAccessor::findImagePixel(const MapDB::ImageSpaceCoord& is,const std::vector<MapAccessor::ImageData>& images,float& img_x,float& img_y,MapDB::ImageHandle & h)
+bool MapAccessor::findImagePixel(const MapDB::ImageSpaceCoord& is,float& img_x,float& img_y,MapDB::ImageHandle & h) const
 {
-	for(int i=images.size()-1;i>=0;--i)
-        if(	       images[i].bottom_left_corner.x               <= is.x
-                && images[i].bottom_left_corner.x + images[i].W >  is.x
-                && images[i].bottom_left_corner.y               <= is.y
-                && images[i].bottom_left_corner.y + images[i].H >  is.y )
-		{
-            h = images[i].handle;
+    // Images containing the point, topmost (i.e. drawn last) first. The vector is kept between calls to avoid
+    // allocating for each pixel in extractTile().
 
-            img_x = is.x - images[i].bottom_left_corner.x;
-            img_y = images[i].H - 1 - (is.y - images[i].bottom_left_corner.y);
+    thread_local std::vector<MapDB::ImageHandle> candidates;
+    mSpatialIndex.queryPoint(is,candidates);
 
-            int X = (int)floor(img_x) ;
-            int Y = (int)floor(img_y) ;
+	for(uint32_t i=0;i<candidates.size();++i)
+	{
+        ImageSpatialIndex::Rect r;
+        mSpatialIndex.getRect(candidates[i],r);
 
-            if(X < 0 || X >= images[i].W || Y < 0 || Y >= images[i].H)
-                continue;
+        h = candidates[i];
 
-            if(mImageMask.width() == images[i].W && mImageMask.height() == images[i].H && mImageMask.pixel(X,Y) == 0)
-                continue;
+        img_x = is.x - r.x;
+        img_y = r.H - 1 - (is.y - r.y);
+
+        int X = (int)floor(img_x) ;
+        int Y = (int)floor(img_y) ;
+
+        if(X < 0 || X >= r.W || Y < 0 || Y >= r.H)
+            continue;
+
+        if(mImageMask.width() == r.W && mImageMask.height() == r.H && mImageMask.pixel(X,Y) == 0)
+            continue;
 
-            return true;
-		}
+        return true;
+	}
 
     return false;
 }
 
-QImage MapAccessor::extractTile(const MapDB::ImageSpaceCoord& bottom_left, const MapDB::ImageSpaceCoord& top_right, int W, int H)
+// Images are composited one output line at a time: each image crossing the line covers a contiguous span of
+// output pixels, which is resampled at once, topmost image first. Pixels already covered by an image, or hidden
+// by the image mask, are left to the images below.
+
+struct MapAccessor::ScanlineScratch
 {
-    std::vector<ImageData> images ;
-    getImagesToDraw(bottom_left,top_right,images);
+    struct Source
+    {
+        QImage image;		// pinned in the cache until the end of extractTile()
+        QVector<QRgb> color_table;	// palette images only
+    };
 
-    QImage img(W,H,QImage::Format_RGB32);
-	float img_x,img_y;
+    std::vector<unsigned char> covered;		// one flag per output pixel of the current line
+    std::vector<MapDB::ImageHandle> handles;
+    std::unordered_map<uint32_t,Source> sources;	// images used so far, fetched once per tile
+};
 
-    for(int i=0;i<W;++i)
-       for(int j=0;j<H;++j)
+// Computes the range [i0,i1) of output pixels which x coordinate falls in [xmin,xmax).
+
+static void columnSpan(const float *xs,int W,float xmin,float xmax,int& i0,int& i1)
+{
+    if(xs[W-1] >= xs[0])
+    {
+        i0 = std::lower_bound(xs,xs+W,xmin) - xs;
+        i1 = std::lower_bound(xs,xs+W,xmax) - xs;
+        return;
+    }
+
+    // decreasing coordinates
+
+    i0 = 0;
+    while(i0 < W && !(xs[i0] < xmax)) ++i0;
+    i1 = i0;
+    while(i1 < W && xs[i1] >= xmin) ++i1;
+}
+
+void MapAccessor::compositeLine(const float *xs,int W,float y,QRgb *line,ScanlineScratch& scratch) const
+{
+    scratch.covered.assign(W,0);
+    mSpatialIndex.query(MapDB::ImageSpaceCoord(xs[0],y),MapDB::ImageSpaceCoord(xs[W-1],y),scratch.handles);
+
+    int remaining = W;
+
+    for(int k=int(scratch.handles.size())-1;k>=0 && remaining>0;--k)
+    {
+        MapDB::ImageHandle h = scratch.handles[k];
+        ImageSpatialIndex::Rect r;
+        mSpatialIndex.getRect(h,r);
+
+        if(!(r.y <= y && r.y + r.H > y))
+            continue;
+
+        float img_y = r.H - 1 - (y - r.y);
+        int Y = (int)floor(img_y) ;
+
+        if(Y < 0 || Y >= r.H)
+            continue;
+
+        int i0,i1;
+        columnSpan(xs,W,r.x,r.x + r.W,i0,i1);
+
+        if(i0 >= i1)
+            continue;
+
+        auto sit = scratch.sources.find(h);
+
+        if(sit == scratch.sources.end())
         {
-            MapDB::ImageHandle handle ;
-            MapDB::ImageSpaceCoord c ;
+            ScanlineScratch::Source& s(scratch.sources[h]);
+            s.image = getCachedImage(h,true);
 
-            c.x = bottom_left.x + i/(float)W*(top_right.x - bottom_left.x);
-            c.y = bottom_left.y + j/(float)H*(top_right.y - bottom_left.y);
+            if(s.image.format() == QImage::Format_Indexed8)
+                s.color_table = s.image.colorTable();
 
-            if(! findImagePixel(c,images,img_x,img_y,handle))
-            {
-                img.setPixelColor(i,H-1-j,QRgb(0));
+            sit = scratch.sources.find(h);
+        }
+        const QImage& tile(sit->second.image);
+
+        bool masked = (mImageMask.width() == r.W && mImageMask.height() == r.H);
+
+        auto visible = [&](int i)
+        {
+            if(scratch.covered[i])
+                return false;
+
+            int X = (int)floor(xs[i] - r.x) ;
+
+            if(X < 0 || X >= r.W)
+                return false;
+
+            return !masked || mImageMask.pixel(X,Y) != 0;
+        };
+
+        // resample each run of visible pixels
+
+        for(int i=i0;i<i1;)
+        {
+            while(i < i1 && !visible(i)) ++i;
+
+            int start = i;
+
+            while(i < i1 && visible(i)) ++i;
+
+            if(i == start)
                 continue;
-            }
 
-            int tmp_W,tmp_H;
-            const unsigned char *data = getPixelData(handle,tmp_W,tmp_H);
+            if(tile.format() == QImage::Format_Indexed8)
+                MapRegistration::interpolated_image_span_indexed(tile.constBits(),tile.bytesPerLine(),sit->second.color_table.constData(),tile.width(),tile.height(),xs+start,r.x,img_y,i-start,line+start);
+            else
+                MapRegistration::interpolated_image_span_ABGR(tile.constBits(),tile.bytesPerLine(),tile.width(),tile.height(),xs+start,r.x,img_y,i-start,line+start);
 
-            img.setPixelColor(i,H-1-j,MapRegistration::interpolated_image_color_ABGR(data,tmp_W,tmp_H,img_x,img_y));
+            memset(&scratch.covered[start],1,i-start);
+            remaining -= i-start;
         }
+    }
 
-    return img;
+    if(remaining > 0)
+        for(int i=0;i<W;++i)
+            if(!scratch.covered[i])
+                line[i] = qRgb(0,0,0);
 }
 
-const unsigned char *MapAccessor::getPixelData(MapDB::ImageHandle h,int& W,int& H) const
+QImage MapAccessor::extractTile(const MapDB::ImageSpaceCoord& bottom_left, const MapDB::ImageSpaceCoord& top_right, int W, int H)
 {
-    auto it = mImageCache.find(h) ;
+    QImage img(W,H,QImage::Format_RGB32);
+
+    if(W <= 0 || H <= 0)
+        return img;
+
+    // x coordinate of each output column, the same for all lines
+
+    std::vector<float> xs(W);
 
-    if(mImageCache.end() != it)
+    for(int i=0;i<W;++i)
+        xs[i] = bottom_left.x + i/(float)W*(top_right.x - bottom_left.x);
+
+    // Lines are independent, so bands of lines are composited in parallel. Each line only depends on its own
+    // coordinates, which makes the output identical whatever the number of threads.
+
+    uchar *bits = img.bits();	// detaches once, before the threads start
+    int bytes_per_line = img.bytesPerLine();
+
+#pragma omp parallel
     {
-        W = it->second.width();
-        H = it->second.height();
-        return it->second.bits() ;
+        ScanlineScratch scratch;
+
+#pragma omp for schedule(dynamic,16)
+        for(int j=0;j<H;++j)
+        {
+            float y = bottom_left.y + j/(float)H*(top_right.y - bottom_left.y);
+
+            compositeLine(xs.data(),W,y,reinterpret_cast<QRgb*>(bits + size_t(bytes_per_line)*(H-1-j)),scratch);
+        }
+
+        for(auto it(scratch.sources.begin());it!=scratch.sources.end();++it)
+            releaseCachedImage(it->first);
     }
 
-    QImage img = getImageData(h);
+    return img;
+}
+
+// Images are cached in the format provided by the MapDB. In particular, palette images (e.g. QCT tiles) stay
+// palette-indexed, and their pixel data is shared with the MapDB when possible, so they must not be modified here.
+//
+// The image is loaded outside of the cache lock, so that threads needing different images do not wait for each other.
+// When pin is true, the image must be released with releaseCachedImage() once done with it.
+
+QImage MapAccessor::getCachedImage(MapDB::ImageHandle h,bool pin) const
+{
+    QImage img;
+
+    if(mCache.find(imageKey(h),img,pin))
+        return img;
 
+    img = getImageData(h);
+
+#ifdef DEBUG
     std::cerr << "Loading/caching image data for image handle " << uint32_t(h) << ", format=" << img.format() << std::endl;
+#endif
+
+    mCache.insert(imageKey(h),img,pin);
+
+    return img;
+}
+
+// Converts a palette image into RGBA bytes (as expected by glTexImage2D with GL_RGBA/GL_UNSIGNED_BYTE).
+
+static QImage expandToRGBA(const QImage& image)
+{
+    uint32_t palette[256] = { 0 };
+    uint32_t rgba_palette[256];
+
+    QVector<QRgb> color_table = image.colorTable();
+
+    for(int i=0;i<color_table.size() && i<256;++i)
+        palette[i] = color_table[i];
+
+    paletteToRGBA(palette,rgba_palette);
+
+    QImage rgba(image.width(),image.height(),QImage::Format_RGBA8888);
+
+    expandPalette(image.constBits(),image.bytesPerLine(),rgba_palette,reinterpret_cast<uint32_t*>(rgba.bits()),rgba.bytesPerLine(),image.width(),image.height());
+
+    return rgba;
+}
+
+// Halves an RGBA8888 image (rounding sizes down, but not below 1), averaging each 2x2 block of pixels.
+
+static QImage halveRGBA(const QImage& src)
+{
+    int W = src.width(), H = src.height();
+    int W2 = std::max(1,W/2), H2 = std::max(1,H/2);
+
+    QImage dst(W2,H2,QImage::Format_RGBA8888);
+
+    for(int j=0;j<H2;++j)
+    {
+        const unsigned char *l0 = src.constScanLine(std::min(2*j  ,H-1));
+        const unsigned char *l1 = src.constScanLine(std::min(2*j+1,H-1));
+        unsigned char *out = dst.scanLine(j);
+
+        for(int i=0;i<W2;++i)
+        {
+            int i0 = 4*std::min(2*i,W-1), i1 = 4*std::min(2*i+1,W-1);
+
+            for(int c=0;c<4;++c)
+                out[4*i+c] = (l0[i0+c] + l0[i1+c] + l1[i0+c] + l1[i1+c] + 2) >> 2;
+        }
+    }
+    return dst;
+}
+
+// Textures form a pyramid per image: level 0 is the image at its native resolution, and each level is half the size
+// of the previous one. Levels are built lazily, only when displayed, and cached independently. A level is obtained by
+// halving the previous one when it is in cache, which avoids decoding the image again while zooming out. Palette
+// images are expanded directly in RGBA order.
+//
+// Thread-safe: called by the background loader threads.
+
+QImage MapAccessor::buildTexture(MapDB::ImageHandle h, int level) const
+{
+    QImage texture;
+
+    if(level > 0 && mCache.peek(textureKey(h,level-1),texture))
+        return halveRGBA(texture);
+
+#ifdef DEBUG
+    std::cerr << "Loading/caching image data for image handle " << h << " at level " << level << std::endl;
+#endif
+
+    // Levels > 0 are asked to the MapDB at their final size, which it may decode for less than the full image (e.g. JPEG).
+
+    const std::map<MapDB::ImageHandle,MapDB::RegisteredImage>& images_map = mDb.getFullListOfImages();
+    auto it = images_map.find(h);
+
+    if(it == images_map.end())
+        return texture;
+
+    int W = it->second.W, H = it->second.H;
+    QSize size(std::max(1,W >> level),std::max(1,H >> level));
+
+    QImage image = (level > 0) ? mDb.getScaledImageData(h,size) : mDb.getImageData(h);
+
+    // The mask is defined at the native image size, and scaled along with reduced images.
+
+    bool apply_mask = (mImageMask.width() == W && mImageMask.height() == H);
+
+    if(image.format() == QImage::Format_Indexed8 && !apply_mask)
+        texture = expandToRGBA(image);
+    else
+    {
+        if(apply_mask)
+            image.setAlphaChannel(image.size() == mImageMask.size() ? mImageMask : mImageMask.scaled(image.size()));
+
+        texture = image.convertToFormat(QImage::Format_RGBA8888);
+    }
+
+    // Full size images are halved down to the requested level. Anything else is rescaled to the exact level size.
 
-    W=img.width();
-    H=img.height();
-    mImageCache[h] = img;
+    while(texture.size() != size && std::max(1,texture.width()/2) >= size.width() && std::max(1,texture.height()/2) >= size.height())
+        texture = halveRGBA(texture);
 
-    return mImageCache[h].bits();
+    if(texture.size() != size)
+        texture = texture.scaled(size,Qt::IgnoreAspectRatio,Qt::SmoothTransformation).convertToFormat(QImage::Format_RGBA8888);
+
+    return texture;
 }
-const unsigned char *MapAccessor::getPixelDataForTextureUsage(MapDB::ImageHandle h, int& W, int& H) const
+
+// Textures of screenshot collections are looked up in the disk cache before being built, and stored there once built.
+// Entries are told apart by texture level and mask, and outdated by any change of the image file.
+
+QImage MapAccessor::loadTexture(MapDB::ImageHandle h,int level) const
 {
-    auto it = mImageTextureCache.find(h) ;
+    CHECK_MMA buildTexture(h,level);
+
+    QString source = mDb2->getImagePath(h);
+    uint64_t variant = (mDiskCacheMaskStamp << 8) | uint32_t(level);
+    QImage texture;
+
+    if(mDiskCache.find(source,variant,texture))
+        return texture;
 
-    if(mImageTextureCache.end() != it)
-        return it->second.bits() ;
+    texture = buildTexture(h,level);
+    mDiskCache.insert(source,variant,texture);
+
+    return texture;
+}
+
+// Textures returned here stay pinned in the cache until the next call to getImagesToDraw(), since their data may
+// still be in use for drawing. When wait is false, missing textures are built by the background loader, which
+// stores them (unpinned) in the cache for a later call to find.
+
+const unsigned char *MapAccessor::getPixelDataForTextureUsage(MapDB::ImageHandle h, int level, bool wait, int& W, int& H) const
+{
+    ImageCache::Key key = textureKey(h,level);
+    QImage texture;
 
-    std::cerr << "Loading/caching image data for image handle " << h << std::endl;
+    if(!mCache.find(key,texture,true))
+    {
+        if(!wait)
+        {
+            mLoader.request(key,[this,h,level,key]()
+            {
+                QImage texture = loadTexture(h,level);
+                mCache.insert(key,texture);
+            });
 
-    QImage image = mDb.getImageData(h);
+            W = H = 0;
+            return NULL;
+        }
 
-    if(mImageMask.width() == image.width() || mImageMask.height() == image.height())
-        image.setAlphaChannel(mImageMask);
+        texture = loadTexture(h,level);
+        mCache.insert(key,texture,true);
+    }
 
-    // static bool toto=false;
-    // if(!toto)
-    // {
-    //     image.save("toto.png");
-    //     toto=true;
-    // }
+    mFramePins.push_back(key);
 
-    mImageTextureCache[h] = image.scaled(1024,1024,Qt::IgnoreAspectRatio,Qt::SmoothTransformation).rgbSwapped() ;
-    W = H = 1024;
+    W = texture.width();
+    H = texture.height();
 
-    return mImageTextureCache[h].bits();
+    return texture.constBits();		// the cache keeps a copy of texture, which data is shared with this one
 }
 
 void MapAccessor::moveImage(MapDB::ImageHandle h,float delta_lon,float delta_lat)
@@ -168,6 +508,16 @@ void MapAccessor::moveImage(MapDB::ImageHandle h,float delta_lon,float delta_lat
     CHECK_MMA;
 
     mDb2->moveImage(h,delta_lon,delta_lat);
+    updateSpatialIndex(h);
+}
+
+void MapAccessor::updateSpatialIndex(MapDB::ImageHandle h)
+{
+    const std::map<MapDB::ImageHandle,MapDB::RegisteredImage>& images_map = mDb.getFullListOfImages();
+    auto it = images_map.find(h);
+
+    if(it != images_map.end())
+        mSpatialIndex.update(h,it->second);
 }
 
 void MapAccessor::recomputeDescriptors(MapDB::ImageHandle h)
@@ -191,7 +541,8 @@ QString MapAccessor::fullPath(MapDB::ImageHandle h)
 void MapAccessor::placeImage(MapDB::ImageHandle h,const MapDB::ImageSpaceCoord& new_corner)
 {
     CHECK_MMA;
-    return mDb2->placeImage(h,new_corner);
+    mDb2->placeImage(h,new_corner);
+    updateSpatialIndex(h);
 }
 
 void MapAccessor::setReferencePoint(MapDB::ImageHandle h,int point_x,int point_y)
@@ -2,17 +2,24 @@
 
 #include <QImage>
 #include "MapDB.h"
+#include "ImageCache.h"
+#include "DiskPixelCache.h"
+#include "BackgroundLoader.h"
+#include "ImageSpatialIndex.h"
 
 class MapAccessor
 {
 	public:
-		MapAccessor(MapDB& mdb) ;
+		MapAccessor(MapDB& mdb, size_t cache_size = ImageCache::DEFAULT_MAX_BYTES, size_t disk_cache_size = DiskPixelCache::DEFAULT_MAX_BYTES) ;
+        ~MapAccessor();
 
         struct ImageData
         {
           	int W,H;
             MapDB::ImageSpaceCoord bottom_left_corner ;
-            const unsigned char *texture_data;
+            const unsigned char *texture_data;	// RGBA bytes, texture_W x texture_H. Pinned in the cache until the next call to getImagesToDraw().
+                                                // NULL while the texture is being prepared in the background.
+            int texture_W,texture_H;
             std::vector<MapRegistration::ImageDescriptor> descriptors;
             MapDB::ImageHandle handle;
         };
@@ -20,7 +27,19 @@ class MapAccessor
         const MapDB::ImageSpaceCoord& topRightCorner() const { return mDb.topRightCorner() ; }
         const MapDB::ImageSpaceCoord& BottomLeftCorner()     const { return mDb.bottomLeftCorner() ; }
 
-        void getImagesToDraw(const MapDB::ImageSpaceCoord &mBottomLeftViewCorner, const MapDB::ImageSpaceCoord& mTopRightViewCorner, std::vector<MapAccessor::ImageData>& images_to_draw) const;
+        /*!
+         * \brief getImagesToDraw 	Collects the images to draw in the given view, with their texture data.
+         * \param view_pixel_size	Size of a screen pixel in image space units. Textures are downscaled by powers of 2 so as
+         * 							not to exceed the displayed resolution. 0 means full resolution.
+         * \param wait_for_textures	When false, textures that are not in cache yet are prepared by background threads, and
+         * 							returned with texture_data=NULL. Calling again later returns them once ready.
+         * \param max_texture_size	Largest texture width and height supported (GL_MAX_TEXTURE_SIZE). Larger textures are
+         * 							downscaled further. 0 means no limit.
+         */
+        void getImagesToDraw(const MapDB::ImageSpaceCoord &mBottomLeftViewCorner, const MapDB::ImageSpaceCoord& mTopRightViewCorner, std::vector<MapAccessor::ImageData>& images_to_draw, float view_pixel_size = 0.0f, bool wait_for_textures = true, int max_texture_size = 0) const;
+
+        // Number of textures still being prepared in the background.
+        size_t pendingTextures() const { return mLoader.pending(); }
         QImage getImageData(MapDB::ImageHandle h) const;
         bool getImageParams(MapDB::ImageHandle h, MapDB::RegisteredImage& img);
         const QImage& imageMask() const { return mImageMask ;}
@@ -46,17 +65,42 @@ class MapAccessor
 
         const MapDB& mapDB() const { return mDb ; }
 
-        bool findImagePixel(const MapDB::ImageSpaceCoord& is, const std::vector<MapAccessor::ImageData>& images, float& img_x, float& img_y, MapDB::ImageHandle &h);
+        // Decoded images and texture data share the same cache, and byte budget.
+        void setCacheSize(size_t max_bytes) { mCache.setMaxBytes(max_bytes); }
+        ImageCache::Statistics cacheStatistics() const { return mCache.statistics(); }
+
+        // Textures are also kept on disk, next to the map definition file, so that they need not be decoded again on the
+        // next run. Only used for screenshot collections. A disk cache size of 0 disables it.
+        DiskPixelCache::Statistics diskCacheStatistics() const { return mDiskCache.statistics(); }
+
+        // Finds the topmost image at the given point, and the coordinates of the point in that image.
+        bool findImagePixel(const MapDB::ImageSpaceCoord& is, float& img_x, float& img_y, MapDB::ImageHandle &h) const;
 
 	private:
-        const unsigned char *getPixelDataForTextureUsage(MapDB::ImageHandle, int &W, int &H) const;
-        const unsigned char *getPixelData(MapDB::ImageHandle h,int& W,int& H) const;
+        const unsigned char *getPixelDataForTextureUsage(MapDB::ImageHandle, int level, bool wait, int &W, int &H) const;
+        QImage loadTexture(MapDB::ImageHandle h, int level) const;
+        QImage buildTexture(MapDB::ImageHandle h, int level) const;
+        QImage getCachedImage(MapDB::ImageHandle h, bool pin = false) const;
+        void releaseCachedImage(MapDB::ImageHandle h) const { mCache.unpin(imageKey(h)); }
+
+        // Images and textures (one per level) of the same handle are stored under different keys.
+        static ImageCache::Key imageKey(MapDB::ImageHandle h) { return (uint64_t(uint32_t(h)) << 8) | 0xff; }
+        static ImageCache::Key textureKey(MapDB::ImageHandle h, int level) { return (uint64_t(uint32_t(h)) << 8) | uint32_t(level); }
 
 		QRgb computeInterpolatedPixelValue(const MapDB::ImageSpaceCoord& is) const;
 
+        void updateSpatialIndex(MapDB::ImageHandle h);
+
+        struct ScanlineScratch;
+        void compositeLine(const float *xs, int W, float y, QRgb *line, ScanlineScratch& scratch) const;
+
 		MapDB& mDb;
-        mutable std::map<MapDB::ImageHandle,QImage> mImageTextureCache ;
-        mutable std::map<MapDB::ImageHandle,QImage> mImageCache ;
+        ImageSpatialIndex mSpatialIndex;
+        mutable ImageCache mCache;
+        mutable DiskPixelCache mDiskCache;
+        uint64_t mDiskCacheMaskStamp;		// identifies the mask applied to textures stored in mDiskCache
+        mutable std::vector<ImageCache::Key> mFramePins;	// textures returned by the last getImagesToDraw() call
         mutable QImage mImageMask;
+        mutable BackgroundLoader mLoader;	// declared last, so that running jobs are finished before anything else is destroyed
 };
 
@@ -6,6 +6,8 @@
 #include <QTextStream>
 #include <QtXml>
 #include <QImage>
+#include <QImageReader>
+#include <QElapsedTimer>
 
 #include "config.h"
 #include "MapDB.h"
@@ -23,6 +25,37 @@ void MapDB::includeImage(const MapDB::ImageSpaceCoord& top_left_corner,int W,int
     if(mTopRight.y < top_left_corner.y+H) mTopRight.y = top_left_corner.y+H;
 }
 
+QImage MapDB::loadImageFile(const QString& filename,const QSize& size)
+{
+    QElapsedTimer timer;
+    timer.start();
+
+    QImageReader reader(filename);
+    QSize native_size = reader.size();
+
+    // Qt's JPEG plugin implements scaled reads with libjpeg's DCT scaling, then only rescales the (already reduced) result
+    // to the exact size. Other plugins would decode the full image and rescale it, so they are left alone.
+
+    bool scaled = size.isValid() && reader.format() == "jpeg" && native_size.isValid()
+                    && size.width() < native_size.width() && size.height() < native_size.height();
+
+    if(scaled)
+        reader.setScaledSize(size);
+
+    QImage img = reader.read();
+
+    if(img.isNull())
+    {
+        std::cerr << "Cannot read image " << filename.toStdString() << ": " << reader.errorString().toStdString() << std::endl;
+        return img;
+    }
+
+    std::cerr << "Decoded " << filename.toStdString() << " (" << native_size.width() << "x" << native_size.height() << ") at "
+              << img.width() << "x" << img.height() << (scaled ? " (reduced JPEG decode)" : "") << " in " << timer.elapsed() << " ms" << std::endl;
+
+    return img;
+}
+
 
 
 
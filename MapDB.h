@@ -3,6 +3,7 @@
 #include <map>
 #include <vector>
 #include <QString>
+#include <QSize>
 
 #include "MapRegistration.h"
 
@@ -66,6 +67,11 @@ class MapDB
         virtual const std::map<ImageHandle,MapDB::RegisteredImage>& getFullListOfImages() const =0;
         virtual bool getImageParams(ImageHandle h, MapDB::RegisteredImage& img) const = 0;
         virtual QImage getImageData(ImageHandle h) const =0;
+
+        // Returns image h scaled down to the given size, e.g. for textures displayed far away. Databases which images can be
+        // decoded at a reduced resolution for less than a full decode (see loadImageFile()) should override this. The
+        // default decodes the full image, and leaves the scaling to the caller: the returned image may be larger than size.
+        virtual QImage getScaledImageData(ImageHandle h, const QSize& size) const { (void)size; return getImageData(h); }
         virtual bool imageSpaceCoordinatesToGPSCoordinates(const MapDB::ImageSpaceCoord& ic,MapDB::GPSCoord& g) const=0;
         virtual const ReferencePoint& getReferencePoint(int i) const =0;
         virtual int numberOfReferencePoints() const =0;
@@ -75,6 +81,11 @@ class MapDB
         const ImageSpaceCoord& bottomLeftCorner() const { return mBottomLeft ; }
         const ImageSpaceCoord& topRightCorner() const { return mTopRight ; }
 
+        // Loads an image file, decoded at the given size when valid. JPEG files are then decoded at a reduced resolution
+        // by libjpeg (DCT scaling by 1/2, 1/4 or 1/8), which is much faster than a full decode. Other formats are fully
+        // decoded, at their native size. The decoding time is reported on stderr.
+        static QImage loadImageFile(const QString& filename, const QSize& size = QSize());
+
     protected:
         MapDB(const QString& name) : mName(name) {}
 
@@ -17,3 +17,13 @@ void MapGUIWindow::setMapAccessor(MapAccessor& ma)
 {
     mViewer->setMapAccessor(&ma);
 }
+
+void MapGUIWindow::setTextureMemory(size_t max_bytes)
+{
+    mViewer->setTextureMemory(max_bytes);
+}
+
+void MapGUIWindow::setRegistrationCandidates(int candidates_per_image,bool report_recall)
+{
+    mViewer->setRegistrationCandidates(candidates_per_image,report_recall);
+}
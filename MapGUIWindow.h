@@ -14,6 +14,8 @@ public:
     virtual ~MapGUIWindow();
 
     void setMapAccessor(MapAccessor &ma);
+    void setTextureMemory(size_t max_bytes);
+    void setRegistrationCandidates(int candidates_per_image, bool report_recall);
 
 private:
     MapViewer *mViewer ;
@@ -1,4 +1,9 @@
 #include <math.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <sstream>
 
 #include "MapDB.h"
 
@@ -14,43 +19,124 @@
 #include "opencv2/imgproc/imgproc.hpp"
 
 #include "MaxHeap.h"
+#include "BilinearResample.h"
+#include "FeatureCache.h"
+#include "DescriptorIndexCache.h"
 #include "MapRegistration.h"
 
 static const int MIN_HAESSIAN    = 35000;
 static const int N_OCTAVES       = 8;
 static const int N_OCTAVE_LAYERS = 4;
 
-QColor MapRegistration::interpolated_image_color_BGR(const unsigned char *data,int W,int H,float i,float j)
+// Progress messages of the registration loops, which run on several threads. Each message is written at once, so that
+// messages of different threads never interleave.
+
+class ProgressReporter
 {
-    int I = (int)floor(i) ;
-    int J = (int)floor(j) ;
+public:
+    ProgressReporter(const std::string& task,size_t total) : mTask(task), mTotal(total), mDone(0) {}
 
-    float di = i - I;
-    float dj = j - J;
+    static void message(const std::string& text)
+    {
+        static std::mutex mtx;
+        std::lock_guard<std::mutex> lock(mtx);
 
-    int index = I+W*J ;
+        std::cerr << text << std::endl;
+    }
+
+    // One more item done. The progress is reported every percent.
+    void step()
+    {
+        size_t done = ++mDone;
 
-    int r = (1-di)*((1-dj)*data[3*(index+0+0) + 2] + dj*data[3*(index+0+W) + 2]) + di*((1-dj)*data[3*(index+1+0) + 2] + dj*data[3*(index+1+W) + 2]);
-    int g = (1-di)*((1-dj)*data[3*(index+0+0) + 1] + dj*data[3*(index+0+W) + 1]) + di*((1-dj)*data[3*(index+1+0) + 1] + dj*data[3*(index+1+W) + 1]);
-    int b = (1-di)*((1-dj)*data[3*(index+0+0) + 0] + dj*data[3*(index+0+W) + 0]) + di*((1-dj)*data[3*(index+1+0) + 0] + dj*data[3*(index+1+W) + 0]);
+        if(done*100/mTotal != (done-1)*100/mTotal)
+        {
+            std::ostringstream o;
+            o << "  " << mTask << ": " << done << " / " << mTotal;
+            message(o.str());
+        }
+    }
 
-    return QColor(r,g,b);
+private:
+    std::string mTask;
+    size_t mTotal;
+    std::atomic<size_t> mDone;
+};
+
+// Keypoints and descriptors of an image, loaded from its sidecar file when the image and the SURF parameters have not
+// changed since they were computed.
+
+static const FeatureCache::Parameters SURF_PARAMETERS = { MIN_HAESSIAN, N_OCTAVES, N_OCTAVE_LAYERS, true, true };
+
+static FeatureCache& featureCache()
+{
+    static FeatureCache cache(SURF_PARAMETERS);
+    return cache;
 }
-QColor MapRegistration::interpolated_image_color_ABGR(const unsigned char *data,int W,int H,float i,float j)
+
+static void computeFeatures(const std::string& image_filename,FeatureCache::Features& features)
 {
-    int I = (int)floor(i) ;
-    int J = (int)floor(j) ;
+    FeatureCache& cache(featureCache());
 
-    float di = i - I;
-    float dj = j - J;
+    uint64_t content_hash = 0;
+    bool hashed = FeatureCache::contentHash(image_filename,content_hash);
+
+    if(hashed && cache.find(image_filename,content_hash,features))
+        return;
+
+    ProgressReporter::message("  computing keypoints for " + image_filename);
 
-    int index = I+W*J ;
+    cv::Mat img = cv::imread( image_filename.c_str(), cv::IMREAD_GRAYSCALE);
 
-    int r = (1-di)*((1-dj)*data[4*(index+0+0) + 2] + dj*data[4*(index+0+W) + 2]) + di*((1-dj)*data[4*(index+1+0) + 2] + dj*data[4*(index+1+W) + 2]);
-    int g = (1-di)*((1-dj)*data[4*(index+0+0) + 1] + dj*data[4*(index+0+W) + 1]) + di*((1-dj)*data[4*(index+1+0) + 1] + dj*data[4*(index+1+W) + 1]);
-    int b = (1-di)*((1-dj)*data[4*(index+0+0) + 0] + dj*data[4*(index+0+W) + 0]) + di*((1-dj)*data[4*(index+1+0) + 0] + dj*data[4*(index+1+W) + 0]);
+    if( !img.data ) throw std::runtime_error("Cannot reading image " + image_filename);
 
-    return QColor(r,g,b);
+    cv::xfeatures2d::SURF_Impl detector(SURF_PARAMETERS.min_hessian,SURF_PARAMETERS.n_octaves,SURF_PARAMETERS.n_octave_layers,SURF_PARAMETERS.extended,SURF_PARAMETERS.upright);
+
+    features.descriptors.release();		// may point into a sidecar file
+    features.mapping.reset();
+
+    detector.detectAndCompute( img, cv::Mat(), features.keypoints, features.descriptors );
+
+    if(hashed)
+        cache.insert(image_filename,content_hash,features);
+}
+
+// The colour helpers only differ by the source pixel format. They all go through the line resampling kernels, which
+// clamp the neighbours to the image border.
+
+QColor MapRegistration::interpolated_image_color_BGR(const unsigned char *data,int W,int H,float i,float j)
+{
+    uint32_t c;
+    bilinearSpanBGR(data,3*W,W,H,&i,0.0f,j,1,&c);
+
+    return QColor(c);
+}
+QColor MapRegistration::interpolated_image_color_ABGR(const unsigned char *data,int W,int H,float i,float j)
+{
+    uint32_t c;
+    bilinearSpanBGRA(data,4*W,W,H,&i,0.0f,j,1,&c);
+
+    return QColor(c);
+}
+QColor MapRegistration::interpolated_image_color_indexed(const unsigned char *data,const QRgb *palette,int W,int H,float i,float j)
+{
+    uint32_t c;
+    bilinearSpanIndexed(data,W,palette,W,H,&i,0.0f,j,1,&c);
+
+    return QColor(c);
+}
+
+void MapRegistration::interpolated_image_span_BGR(const unsigned char *data,int stride,int W,int H,const float *x,float x_offset,float j,int n,QRgb *out)
+{
+    bilinearSpanBGR(data,stride,W,H,x,x_offset,j,n,out);
+}
+void MapRegistration::interpolated_image_span_ABGR(const unsigned char *data,int stride,int W,int H,const float *x,float x_offset,float j,int n,QRgb *out)
+{
+    bilinearSpanBGRA(data,stride,W,H,x,x_offset,j,n,out);
+}
+void MapRegistration::interpolated_image_span_indexed(const unsigned char *data,int stride,const QRgb *palette,int W,int H,const float *x,float x_offset,float j,int n,QRgb *out)
+{
+    bilinearSpanIndexed(data,stride,palette,W,H,x,x_offset,j,n,out);
 }
 
 float MapRegistration::interpolated_image_intensity(const unsigned char *data,int W,int H,float i,float j)
@@ -61,31 +147,29 @@ float MapRegistration::interpolated_image_intensity(const unsigned char *data,in
     float di = i - I;
     float dj = j - J;
 
-    int index = I+W*J ;
+    // neighbours are clamped to the image border
+
+    int I0 = std::max(0,std::min(W-1,I)), I1 = std::max(0,std::min(W-1,I+1));
+    int J0 = std::max(0,std::min(H-1,J)), J1 = std::max(0,std::min(H-1,J+1));
+
+    const unsigned char *p00 = data + 4*(I0+W*J0), *p10 = data + 4*(I1+W*J0);
+    const unsigned char *p01 = data + 4*(I0+W*J1), *p11 = data + 4*(I1+W*J1);
 
-    float d_00 = 0.30 * data[4*(index+0+0) + 2] + 0.59 * data[4*(index+0+0) + 1] + 0.11 * data[4*(index+0+0)+0] ;
-    float d_10 = 0.30 * data[4*(index+1+0) + 2] + 0.59 * data[4*(index+1+0) + 1] + 0.11 * data[4*(index+1+0)+0] ;
-    float d_11 = 0.30 * data[4*(index+1+W) + 2] + 0.59 * data[4*(index+1+W) + 1] + 0.11 * data[4*(index+1+W)+0] ;
-    float d_01 = 0.30 * data[4*(index+0+W) + 2] + 0.59 * data[4*(index+0+W) + 1] + 0.11 * data[4*(index+0+W)+0] ;
+    float d_00 = 0.30 * p00[2] + 0.59 * p00[1] + 0.11 * p00[0] ;
+    float d_10 = 0.30 * p10[2] + 0.59 * p10[1] + 0.11 * p10[0] ;
+    float d_11 = 0.30 * p11[2] + 0.59 * p11[1] + 0.11 * p11[0] ;
+    float d_01 = 0.30 * p01[2] + 0.59 * p01[1] + 0.11 * p01[0] ;
 
     return ((1-di)*((1-dj)*d_00 + dj*d_01) + di*((1-dj)*d_10 + dj*d_11))/255.0 ;
 }
 
 void  MapRegistration::findDescriptors(const std::string& image_filename,const QImage& mask,std::vector<MapRegistration::ImageDescriptor>& descriptors)
 {
-    cv::Mat img = cv::imread( image_filename.c_str(), cv::IMREAD_GRAYSCALE );
-
-	if( !img.data )
-		throw std::runtime_error("Cannot reading image " + image_filename);
-
 	//-- Step 1: Detect the keypoints using SURF Detector
-    int minHessian = MIN_HAESSIAN;
-
-    cv::xfeatures2d::SURF_Impl detector(minHessian,N_OCTAVES,N_OCTAVE_LAYERS,true,true);
-
-    std::vector<cv::KeyPoint> keypoints;
+    FeatureCache::Features features;
+    computeFeatures(image_filename,features);
 
-	detector.detect( img, keypoints );
+    const std::vector<cv::KeyPoint>& keypoints(features.keypoints);
 
     descriptors.clear();
 
@@ -103,7 +187,7 @@ void  MapRegistration::findDescriptors(const std::string& image_filename,const Q
     }
 }
 
-static bool bruteForceCheckMatchConsistency(const QImage& mask,const std::string& image_filename1,const std::string& image_filename2,double delta_x,double delta_y,bool verbose=false)
+static bool bruteForceCheckMatchConsistency(const QImage& mask,const std::string& image_filename1,const std::string& image_filename2,double delta_x,double delta_y,std::ostream& log,bool verbose=false)
 {
     cv::Mat tmp = cv::imread( image_filename1.c_str(), cv::IMREAD_COLOR);
     if( !tmp.data ) throw std::runtime_error("Cannot reading image " + image_filename1);
@@ -131,36 +215,55 @@ static bool bruteForceCheckMatchConsistency(const QImage& mask,const std::string
     int common_region_size=0;
     int matching_pixels=0;
 
+    // Images are compared line by line: both lines are resampled at once, over the range of pixels common to both images.
+
+    int i0 = std::max(0,(int)ceil(delta_x));
+    int i1 = std::min(W1,(int)ceil(W2+delta_x));
+
+    std::vector<float> xs(W1);
+    std::vector<QRgb> line1(W1),line2(W1);
+
     for(int i=0;i<W1;++i)
-        for(int j=0;j<H1;++j)
+        xs[i] = i;
+
+    for(int j=0;j<H1;++j)
+    {
+        float y1 = j;
+        float y2 = j-delta_y;
+
+        if(y2 < 0.0 || y2 >= H2 || i0 >= i1)
+            continue;
+
+        MapRegistration::interpolated_image_span_BGR(img1.data,(int)img1.step[0],W1,H1,&xs[i0],0.0f ,y1,i1-i0,&line1[i0]);
+        MapRegistration::interpolated_image_span_BGR(img2.data,(int)img2.step[0],W2,H2,&xs[i0],delta_x,y2,i1-i0,&line2[i0]);
+
+        for(int i=i0;i<i1;++i)
         {
             float x1 = i;
-            float y1 = j;
-
             float x2 = i-delta_x;
-            float y2 = j-delta_y;
 
-            if(x2 >= 0.0 && x2 < W2 && y2 >= 0.0 && y2 < H2 && (  (mask.width() == 0 || mask.height() == 0) || (mask.pixel(x1,y1) != 0 && mask.pixel(x2,y2) != 0)) )
+            if(x2 >= 0.0 && x2 < W2 && (  (mask.width() == 0 || mask.height() == 0) || (mask.pixel(x1,y1) != 0 && mask.pixel(x2,y2) != 0)) )
             {
                 common_region_size++;
 
-                QColor c1 = MapRegistration::interpolated_image_color_BGR(img1.data,W1,H1,x1,y1);
-                QColor c2 = MapRegistration::interpolated_image_color_BGR(img2.data,W2,H2,x2,y2);
+                QRgb c1 = line1[i];
+                QRgb c2 = line2[i];
 
-                double dist = sqrt(pow(c1.redF() - c2.redF(),2) + pow(c1.greenF() - c2.greenF(),2) + pow(c1.blueF() - c2.blueF(),2));
+                double dist = sqrt(pow((qRed(c1) - qRed(c2))/255.0,2) + pow((qGreen(c1) - qGreen(c2))/255.0,2) + pow((qBlue(c1) - qBlue(c2))/255.0,2));
 
                 if(verbose)
                 {
-                    std::cerr << "Comparing pixel (" << x1 << "," << y1 << ") color ( " << c1.redF() << "," << c1.greenF() << "," << c1.blueF() << ") of " << image_filename1 <<
-                                 " and pixel (" << x2 << "," << y2 << ") color ( " << c2.redF() << "," << c2.greenF() << "," << c2.blueF() << ") of " << image_filename2 ;
+                    std::cerr << "Comparing pixel (" << x1 << "," << y1 << ") color ( " << qRed(c1)/255.0 << "," << qGreen(c1)/255.0 << "," << qBlue(c1)/255.0 << ") of " << image_filename1 <<
+                                 " and pixel (" << x2 << "," << y2 << ") color ( " << qRed(c2)/255.0 << "," << qGreen(c2)/255.0 << "," << qBlue(c2)/255.0 << ") of " << image_filename2 ;
                     std::cerr << " dist = " << dist << std::endl;
                 }
                 if(dist < 0.02)
                     ++matching_pixels;
             }
         }
+    }
 
-    std::cerr << " common: " << common_region_size << " matching: "<< matching_pixels ;
+    log << " common: " << common_region_size << " matching: "<< matching_pixels ;
 
     if(common_region_size > 0.05*std::min(W1,H1)*std::min(W2,H2) && matching_pixels > 0.5*common_region_size)
         return true;
@@ -168,18 +271,45 @@ static bool bruteForceCheckMatchConsistency(const QImage& mask,const std::string
         return false;
 }
 
-static bool computeTransform(const QImage& mask,const std::vector<cv::KeyPoint>& keypoints1,const std::vector<cv::KeyPoint>& keypoints2,const cv::Mat& descriptors_1,const cv::Mat& descriptors_2,float& dx,float& dy,bool verbose=false)
+// Nearest neighbour in descriptors_2 of each descriptor of descriptors_1, through index_2 when given. Otherwise, small
+// sets are matched exhaustively, which beats building an index used only once.
+
+static const int BRUTE_FORCE_MAX_DESCRIPTORS = 256;
+
+static void matchDescriptors(const cv::Mat& descriptors_1,const cv::Mat& descriptors_2,cv::flann::Index *index_2,std::vector<cv::DMatch>& matches)
 {
-	//-- Step 2: Matching descriptor vectors using FLANN matcher
-	cv::FlannBasedMatcher matcher;
-	std::vector<cv::DMatch> matches;
+    matches.clear();
+
+    if(descriptors_1.rows == 0 || descriptors_2.rows == 0)
+        return;
+
+    if(index_2 != NULL)
+    {
+        // Searches only read the index: it is shared by the threads matching the same image.
+
+        cv::Mat indices,dists;
+        index_2->knnSearch(descriptors_1,indices,dists,1,cv::flann::SearchParams());
+
+        // FLANN gives squared L2 distances, cv::DescriptorMatcher gives L2 distances.
+
+        for(int i=0;i<descriptors_1.rows;++i)
+            matches.push_back(cv::DMatch(i,indices.at<int>(i,0),sqrt(dists.at<float>(i,0))));
+    }
+    else if(descriptors_2.rows <= BRUTE_FORCE_MAX_DESCRIPTORS)
+        cv::BFMatcher(cv::NORM_L2).match(descriptors_1, descriptors_2, matches);
+    else
+        cv::FlannBasedMatcher().match(descriptors_1, descriptors_2, matches);
+}
 
-	matcher.match(descriptors_1, descriptors_2, matches);
+static bool computeTransform(const QImage& mask,const std::vector<cv::KeyPoint>& keypoints1,const std::vector<cv::KeyPoint>& keypoints2,const std::vector<cv::DMatch>& matches,float& dx,float& dy,bool verbose=false)
+{
+    if(matches.empty())
+        return false;
 
 	double max_dist = 0; double min_dist = 100;
 
 	//-- Quick calculation of max and min distances between keypoints
-	for( int i = 0; i < descriptors_1.rows; i++ )
+	for( uint32_t i = 0; i < matches.size(); i++ )
 	{
 		double dist = matches[i].distance;
 		if( dist < min_dist ) min_dist = dist;
@@ -199,7 +329,7 @@ static bool computeTransform(const QImage& mask,const std::vector<cv::KeyPoint>&
 
 	std::vector<cv::Point2f> good_matches;
 
-	for( int i = 0; i<descriptors_1.rows; i++ )
+	for( uint32_t i = 0; i<matches.size(); i++ )
 	{
 		float delta_x,delta_y ;
 
@@ -291,52 +421,159 @@ static bool computeTransform(const QImage& mask,const std::vector<cv::KeyPoint>&
 	return true;
 }
 
-bool MapRegistration::computeRelativeTransform(const QImage& mask,const std::string& image_filename1,const std::string& image_filename2,float& dx,float& dy)
+// Pairs made of each image and the candidates_per_image images with the most similar signatures, sorted. Signatures
+// are tf-idf weighted histograms of visual words: the descriptors of a sample of keypoints of all images are clustered
+// into words, and each keypoint of an image votes for the word closest to its descriptor. Keypoints outside of the mask
+// are ignored, as in computeTransform.
+
+static std::vector<std::pair<int,int> > candidatePairs(const QImage& mask,const std::vector<FeatureCache::Features>& features,int candidates_per_image)
 {
-	cv::Mat img1 = cv::imread( image_filename1.c_str(), cv::IMREAD_GRAYSCALE);
-	if( !img1.data ) throw std::runtime_error("Cannot reading image " + image_filename1);
+    static const int NB_WORDS                  = 128;
+    static const int MAX_SAMPLES_PER_IMAGE     = 100;
+    static const int MAX_VOCABULARY_ITERATIONS = 10;
 
-	cv::Mat img2 = cv::imread( image_filename2.c_str(), cv::IMREAD_GRAYSCALE);
-	if( !img2.data ) throw std::runtime_error("Cannot reading image " + image_filename2);
+    int n = features.size();
+    bool use_mask = mask.width() != 0 && mask.height() != 0;
 
-    int minHessian = MIN_HAESSIAN;
+    // 1 - vocabulary
 
-    cv::xfeatures2d::SURF_Impl detector(minHessian,N_OCTAVES,N_OCTAVE_LAYERS,true,true);
+    cv::Mat samples;
 
-    std::vector<cv::KeyPoint> keypoints1,keypoints2;
-    cv::Mat descriptors_1,descriptors_2;
+    for(int i=0;i<n;++i)
+    {
+        int nb_keypoints = features[i].keypoints.size();
+        int step = std::max(1,nb_keypoints / MAX_SAMPLES_PER_IMAGE);
 
-	detector.detectAndCompute( img1, cv::Mat(), keypoints1, descriptors_1 );
-	detector.detectAndCompute( img2, cv::Mat(), keypoints2, descriptors_2 );
+        for(int k=0;k<nb_keypoints && features[i].descriptors.type() == CV_32F;k+=step)
+            if(!use_mask || mask.pixel((int)features[i].keypoints[k].pt.x,(int)features[i].keypoints[k].pt.y) != 0)
+                samples.push_back(features[i].descriptors.row(k));
+    }
 
-    return computeTransform(mask,keypoints1,keypoints2,descriptors_1,descriptors_2,dx,dy,true);
-}
+    std::vector<std::pair<int,int> > pairs;
 
-bool MapRegistration::computeAllImagesPositions(const QImage& mask,const std::vector<std::string>& image_filenames,std::vector<std::pair<float,float> >& top_left_corners)
-{
-    if(image_filenames.empty())
-        return false ;
+    if(samples.rows < NB_WORDS)
+        return pairs;
 
-    std::vector<std::vector<cv::KeyPoint> >keypoints(image_filenames.size());
-    std::vector<cv::Mat> descriptors(image_filenames.size());
+    cv::Mat labels,vocabulary;
+    cv::theRNG() = cv::RNG(0x9e3779b97f4a7c15ull);
+    cv::kmeans(samples, NB_WORDS, labels, cv::TermCriteria(cv::TermCriteria::EPS + cv::TermCriteria::COUNT,MAX_VOCABULARY_ITERATIONS,0.01), 1, cv::KMEANS_PP_CENTERS, vocabulary);
 
-    // compute descriptors for all images
+    // 2 - word histograms
 
-#pragma omp parallel for
-    for(uint32_t i=0;i<image_filenames.size();++i)
+    std::vector<std::vector<float> > signatures(n,std::vector<float>(NB_WORDS,0.0f));
+
+#pragma omp parallel for schedule(dynamic,1)
+    for(int i=0;i<n;++i)
+    {
+        if(features[i].descriptors.rows == 0 || features[i].descriptors.type() != CV_32F)
+            continue;
+
+        cv::BFMatcher matcher(cv::NORM_L2);
+        std::vector<cv::DMatch> words;
+
+        matcher.match(features[i].descriptors, vocabulary, words);
+
+        for(uint32_t k=0;k<words.size();++k)
+        {
+            const cv::KeyPoint& kp(features[i].keypoints[words[k].queryIdx]);
+
+            if(!use_mask || mask.pixel((int)kp.pt.x,(int)kp.pt.y) != 0)
+                signatures[i][words[k].trainIdx] += 1.0f;
+        }
+    }
+
+    std::vector<float> idf(NB_WORDS,0.0f);
+
+    for(int i=0;i<n;++i)
+        for(int w=0;w<NB_WORDS;++w)
+            if(signatures[i][w] > 0.0f)
+                idf[w] += 1.0f;
+
+    for(int w=0;w<NB_WORDS;++w)
+        idf[w] = (idf[w] > 0.0f) ? log(n / idf[w]) : 0.0f;
+
+    for(int i=0;i<n;++i)
     {
-        std::cerr << "  computing keypoints for " << image_filenames[i] << std::endl;
+        float norm = 0.0f;
+
+        for(int w=0;w<NB_WORDS;++w)
+        {
+            signatures[i][w] *= idf[w];
+            norm += signatures[i][w]*signatures[i][w];
+        }
+
+        if(norm > 0.0f)
+            for(int w=0;w<NB_WORDS;++w)
+                signatures[i][w] /= sqrt(norm);
+    }
 
-		cv::Mat img = cv::imread( image_filenames[i].c_str(), cv::IMREAD_GRAYSCALE);
+    // 3 - most similar images. Ties are broken by index, so that the candidates do not depend on thread scheduling.
 
-		if( !img.data ) throw std::runtime_error("Cannot reading image " + image_filenames[i]);
+    std::vector<std::vector<int> > candidates(n);
 
-        int minHessian = MIN_HAESSIAN;
-        cv::xfeatures2d::SURF_Impl detector(minHessian,N_OCTAVES,N_OCTAVE_LAYERS,true,true);
+#pragma omp parallel for schedule(dynamic,16)
+    for(int i=0;i<n;++i)
+    {
+        std::vector<std::pair<float,int> > similarities;
+        similarities.reserve(n-1);
+
+        for(int j=0;j<n;++j)
+            if(j != i)
+            {
+                float s = 0.0f;
+
+                for(int w=0;w<NB_WORDS;++w)
+                    s += signatures[i][w]*signatures[j][w];
+
+                similarities.push_back(std::make_pair(-s,j));
+            }
 
-		detector.detectAndCompute( img, cv::Mat(), keypoints[i], descriptors[i] );
+        int k = std::min(candidates_per_image,n-1);
+        std::partial_sort(similarities.begin(),similarities.begin()+k,similarities.end());
+
+        for(int l=0;l<k;++l)
+            candidates[i].push_back(similarities[l].second);
     }
 
+    for(int i=0;i<n;++i)
+        for(uint32_t l=0;l<candidates[i].size();++l)
+            pairs.push_back(std::make_pair(std::min(i,candidates[i][l]),std::max(i,candidates[i][l])));
+
+    std::sort(pairs.begin(),pairs.end());
+    pairs.erase(std::unique(pairs.begin(),pairs.end()),pairs.end());
+
+    return pairs;
+}
+
+bool MapRegistration::computeRelativeTransform(const QImage& mask,const std::string& image_filename1,const std::string& image_filename2,float& dx,float& dy)
+{
+    FeatureCache::Features features1,features2;
+
+    computeFeatures(image_filename1,features1);
+    computeFeatures(image_filename2,features2);
+
+    std::vector<cv::DMatch> matches;
+    matchDescriptors(features1.descriptors,features2.descriptors,NULL,matches);
+
+    return computeTransform(mask,features1.keypoints,features2.keypoints,matches,dx,dy,true);
+}
+
+bool MapRegistration::computeAllImagesPositions(const QImage& mask,const std::vector<std::string>& image_filenames,std::vector<std::pair<float,float> >& top_left_corners,
+                                                int candidates_per_image,bool report_recall)
+{
+    if(image_filenames.empty())
+        return false ;
+
+    std::vector<FeatureCache::Features> features(image_filenames.size());
+
+    // compute descriptors for all images, or load them if they did not change
+
+    FeatureCache::Statistics initial_feature_stats = featureCache().statistics();
+
+#pragma omp parallel for
+    for(uint32_t i=0;i<image_filenames.size();++i)
+        computeFeatures(image_filenames[i],features[i]);
+
     top_left_corners.clear();
     top_left_corners.resize(image_filenames.size(),std::make_pair(0.0,0.0));
 
@@ -362,7 +599,10 @@ bool MapRegistration::computeAllImagesPositions(const QImage& mask,const std::ve
                 {
                     std::cerr << "  testing " << i << " vs. " << j << std::endl;
 
-					if(has_coords[j] && computeTransform(mask,keypoints[j],keypoints[i],descriptors[j],descriptors[i],delta_x,delta_y))
+                    std::vector<cv::DMatch> matches;
+                    matchDescriptors(features[j].descriptors,features[i].descriptors,NULL,matches);
+
+					if(has_coords[j] && computeTransform(mask,features[j].keypoints,features[i].keypoints,matches,delta_x,delta_y))
 					{
                         std::cerr << "Found new coordinates for image " << i << " w.r.t. image " << j << ": delta=" << delta_x << ", " << delta_y << std::endl;
 						top_left_corners[i] = std::make_pair(top_left_corners[j].first - delta_x, top_left_corners[j].second + delta_y);
@@ -391,47 +631,188 @@ bool MapRegistration::computeAllImagesPositions(const QImage& mask,const std::ve
 
     std::vector<std::list<NStruct> > neighbours(image_filenames.size());
 
-    for(int i=0;i<(int)image_filenames.size();++i)
+    // Pairs are evaluated in parallel, each thread keeping the pairs it validated. Since the time spent per pair varies a
+    // lot (the consistency check only runs on candidate pairs), pairs are handed out one at a time.
+
+    struct Edge
+    {
+        int i,j;
+        float delta_x;
+        float delta_y;
+
+        bool operator<(const Edge& e) const { return i < e.i || (i == e.i && j < e.j); }
+    };
+
+    // Unless all pairs are asked for, only pairs of images that look alike are matched.
+
+    std::vector<std::pair<int,int> > pairs,candidates;
+    bool all_pairs = candidates_per_image <= 0 || candidates_per_image+1 >= (int)image_filenames.size();
+
+    if(!all_pairs)
+    {
+        candidates = candidatePairs(mask,features,candidates_per_image);
+
+        if(candidates.empty())
+            all_pairs = true;		// not enough keypoints to build a vocabulary
+    }
+
+    if(all_pairs || report_recall)
+    {
+        for(int i=0;i<(int)image_filenames.size();++i)
+            for(int j=i+1;j<(int)image_filenames.size();++j)
+                pairs.push_back(std::make_pair(i,j));
+    }
+    else
+        pairs = candidates;
+
+    std::cerr << "Matching " << pairs.size() << " image pairs out of " << image_filenames.size()*(image_filenames.size()-1)/2 << std::endl;
+
+    // Pairs are sorted by their first image, which descriptors are indexed once and queried by all its pairs. The time
+    // spent matching descriptors is measured for both matching methods, to compare them on actual data.
+
+    DescriptorIndexCache index_cache;
+
+    std::vector<Edge> edges;
+    std::string error;
+    ProgressReporter progress("matching image pairs",pairs.size());
+
+    uint32_t nb_index_matches = 0,nb_brute_force_matches = 0;
+    double index_matching_seconds = 0.0,brute_force_matching_seconds = 0.0;
+
+#pragma omp parallel
     {
-        for(int j=i+1;j<(int)image_filenames.size();++j)
+        std::vector<Edge> thread_edges;
+
+        uint32_t thread_index_matches = 0,thread_brute_force_matches = 0;
+        double thread_index_seconds = 0.0,thread_brute_force_seconds = 0.0;
+
+#pragma omp for schedule(dynamic,1) nowait
+        for(int k=0;k<(int)pairs.size();++k)
         {
-            // try to match to one of the previous images
-            float delta_x,delta_y;
+            int i = pairs[k].first;
+            int j = pairs[k].second;
 
-            if(computeTransform(mask,keypoints[j],keypoints[i],descriptors[j],descriptors[i],delta_x,delta_y))
-            {
-                std::cerr << " Image " << i << " is neighbour to image " << j << ": delta=" << delta_x << ", " << delta_y ;
-                std::cerr.flush();
-                std::cerr << ". Checking consistency..." ;
-                std::cerr.flush();
+            // kmeans draws from the RNG of the current thread: it is seeded per pair, so that results do not depend on
+            // which thread evaluated which pairs before.
 
-                //	2 - test consistency of translations between images: for each image pair, translate the files and check how much pixels actually match
+            cv::theRNG() = cv::RNG(0x9e3779b97f4a7c15ull ^ (uint64_t(i) << 32 | uint32_t(j)));
 
-                if(bruteForceCheckMatchConsistency(mask,image_filenames[i],image_filenames[j],delta_x,delta_y))
-                {
-                    std::cerr << " OK" << std::endl;
+            try
+            {
+                // try to match to one of the previous images
+                float delta_x,delta_y;
+
+                std::shared_ptr<cv::flann::Index> index;
 
-                    NStruct S;
-                    S.j = j;
-                    S.delta_x = delta_x;
-                    S.delta_y = delta_y;
+                if(features[i].descriptors.rows > BRUTE_FORCE_MAX_DESCRIPTORS)
+                    index = index_cache.index(i,features[i].descriptors);
 
-                    neighbours[i].push_back(S);
+                std::vector<cv::DMatch> matches;
+                auto start = std::chrono::steady_clock::now();
 
-                    // This needs to be done both ways. Otherwise the graph is not bi-connected and some deadends may appear in the algorithm below.
+                matchDescriptors(features[j].descriptors,features[i].descriptors,index.get(),matches);
 
-                    S.j = i;
-                    S.delta_x = -delta_x;
-                    S.delta_y = -delta_y;
+                std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
 
-                    neighbours[j].push_back(S);
+                if(index)
+                {
+                    ++thread_index_matches;
+                    thread_index_seconds += elapsed.count();
                 }
                 else
-                    std::cerr << " REJECTED" << std::endl;
+                {
+                    ++thread_brute_force_matches;
+                    thread_brute_force_seconds += elapsed.count();
+                }
+
+                if(computeTransform(mask,features[j].keypoints,features[i].keypoints,matches,delta_x,delta_y))
+                {
+                    std::ostringstream log;
+                    log << " Image " << i << " is neighbour to image " << j << ": delta=" << delta_x << ", " << delta_y << ". Checking consistency..." ;
+
+                    //	2 - test consistency of translations between images: for each image pair, translate the files and check how much pixels actually match
+
+                    if(bruteForceCheckMatchConsistency(mask,image_filenames[i],image_filenames[j],delta_x,delta_y,log))
+                    {
+                        log << " OK";
+                        thread_edges.push_back(Edge{ i, j, delta_x, delta_y });
+                    }
+                    else
+                        log << " REJECTED";
+
+                    ProgressReporter::message(log.str());
+                }
             }
+            catch(std::exception& e)
+            {
+#pragma omp critical
+                if(error.empty())
+                    error = e.what();
+            }
+
+            progress.step();
+        }
+
+#pragma omp critical
+        {
+            edges.insert(edges.end(),thread_edges.begin(),thread_edges.end());
+
+            nb_index_matches             += thread_index_matches;
+            nb_brute_force_matches       += thread_brute_force_matches;
+            index_matching_seconds       += thread_index_seconds;
+            brute_force_matching_seconds += thread_brute_force_seconds;
         }
     }
 
+    FeatureCache::Statistics feature_stats = featureCache().statistics();
+    DescriptorIndexCache::Statistics index_stats = index_cache.statistics();
+
+    std::cerr << "Feature cache: " << feature_stats.hits - initial_feature_stats.hits << " images loaded, "
+              << feature_stats.misses - initial_feature_stats.misses << " computed ("
+              << feature_stats.writes - initial_feature_stats.writes << " sidecar files written)" << std::endl;
+
+    std::cerr << "Descriptor matching: " << nb_index_matches << " pairs through an index (" << index_matching_seconds << " s, plus "
+              << index_stats.builds << " index builds in " << index_stats.build_seconds << " s, " << index_stats.evictions << " evictions), "
+              << nb_brute_force_matches << " pairs with at most " << BRUTE_FORCE_MAX_DESCRIPTORS << " descriptors brute force (" << brute_force_matching_seconds << " s)" << std::endl;
+
+    if(!error.empty())
+        throw std::runtime_error(error);
+
+    // Edges are added in the same order as a serial loop over the pairs would, so that the graph traversal below (and
+    // hence the image positions) does not depend on thread scheduling.
+
+    std::sort(edges.begin(),edges.end());
+
+    if(report_recall && !all_pairs)
+    {
+        uint32_t found = 0;
+
+        for(uint32_t k=0;k<edges.size();++k)
+            if(std::binary_search(candidates.begin(),candidates.end(),std::make_pair(edges[k].i,edges[k].j)))
+                ++found;
+
+        std::cerr << "Candidate pairs: " << candidates.size() << " out of " << pairs.size() << " (" << candidates_per_image << " per image). Recall: "
+                  << found << " of the " << edges.size() << " image neighbours (" << (edges.empty() ? 100.0 : 100.0*found/edges.size()) << "%)" << std::endl;
+    }
+
+    for(uint32_t k=0;k<edges.size();++k)
+    {
+        NStruct S;
+        S.j = edges[k].j;
+        S.delta_x = edges[k].delta_x;
+        S.delta_y = edges[k].delta_y;
+
+        neighbours[edges[k].i].push_back(S);
+
+        // This needs to be done both ways. Otherwise the graph is not bi-connected and some deadends may appear in the algorithm below.
+
+        S.j = edges[k].i;
+        S.delta_x = -edges[k].delta_x;
+        S.delta_y = -edges[k].delta_y;
+
+        neighbours[edges[k].j].push_back(S);
+    }
+
     //	3 - test connexity, and compute connex components
 
     int next = 0;
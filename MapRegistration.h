@@ -21,10 +21,24 @@ public:
 
     static void findDescriptors(const std::string& image_filename, const QImage &mask, std::vector<MapRegistration::ImageDescriptor>& descriptors);
  	static bool computeRelativeTransform(const QImage &mask, const std::string& image_filename1, const std::string& image_filename2, float &dx, float &dy);
-	static bool computeAllImagesPositions(const QImage& mask,const std::vector<std::string>& image_filenames,std::vector<std::pair<float,float> >& top_left_corners);
+
+    // Only the candidates_per_image images that look the most alike each image (from a bag of visual words over their
+    // descriptors) are matched with it. 0 matches all pairs. With report_recall, all pairs are matched anyway, and the
+    // proportion of the image neighbours that the candidates would have found is reported.
+    static const int DEFAULT_CANDIDATES_PER_IMAGE = 10;
+
+	static bool computeAllImagesPositions(const QImage& mask,const std::vector<std::string>& image_filenames,std::vector<std::pair<float,float> >& top_left_corners,
+                                          int candidates_per_image = DEFAULT_CANDIDATES_PER_IMAGE,bool report_recall = false);
 	static float interpolated_image_intensity(const unsigned char *data, int W, int H, float i, float j);
 	static QColor interpolated_image_color_ABGR(const unsigned char *data, int W, int H, float i, float j);
     static QColor interpolated_image_color_BGR(const unsigned char *data, int W, int H, float i, float j);
+    static QColor interpolated_image_color_indexed(const unsigned char *data, const QRgb *palette, int W, int H, float i, float j);
+
+    // Same as above for n pixels of the same image line j, at positions x[k]-x_offset. Results are written as opaque QRgb into out.
+    // Image lines are stride bytes apart. See BilinearResample.h.
+    static void interpolated_image_span_BGR(const unsigned char *data, int stride, int W, int H, const float *x, float x_offset, float j, int n, QRgb *out);
+    static void interpolated_image_span_ABGR(const unsigned char *data, int stride, int W, int H, const float *x, float x_offset, float j, int n, QRgb *out);
+    static void interpolated_image_span_indexed(const unsigned char *data, int stride, const QRgb *palette, int W, int H, const float *x, float x_offset, float j, int n, QRgb *out);
 
 private:
 };
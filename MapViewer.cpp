@@ -7,6 +7,7 @@
 #include <QMessageBox>
 #include <QCoreApplication>
 #include <QProgressBar>
+#include <QTimer>
 #include <QDragEnterEvent>
 
 #include "MapAccessor.h"
@@ -14,6 +15,12 @@
 #include "MapDB.h"
 #include "MapExporter.h"
 
+// Textures are prepared by background threads. Uploading them to the graphics card is limited per frame, so that the
+// view stays responsive while many textures arrive at once, and the view is redrawn regularly until all are there.
+
+static const size_t MAX_TEXTURE_UPLOAD_BYTES_PER_FRAME = 16*1024*1024;
+static const int    TEXTURE_POLL_DELAY_MS              = 30;
+
 MapViewer::MapViewer(QWidget *parent)
     : QGLViewer(parent)
 {
@@ -33,13 +40,56 @@ MapViewer::MapViewer(QWidget *parent)
     mMovingSelected = false ;
     mShowImagesBorder = true;
     mShowExportGrid = false;
+    mRedrawScheduled = false;
     mDisplayDescriptor=0;
+    mRegistrationCandidates = MapRegistration::DEFAULT_CANDIDATES_PER_IMAGE;
+    mReportRegistrationRecall = false;
+    mMaxTextureSize = 0;
 
     mViewScale = 1.0;		// 1 pixel = 10000/cm lat/lon
     mCenter.x = 0.0;
     mCenter.y = 0.0;
 }
 
+MapViewer::~MapViewer()
+{
+    std::cerr << textureStatistics().toStdString() << std::endl;
+
+    makeCurrent();
+    mTextures.clear();
+}
+
+// Called when the GL context is (re)created. Textures of a previous context were destroyed along with it.
+
+void MapViewer::init()
+{
+    QGLViewer::init();
+
+    mTextures.clear(false);
+
+    glGetIntegerv(GL_MAX_TEXTURE_SIZE,&mMaxTextureSize);
+}
+
+void MapViewer::setTextureMemory(size_t max_bytes)
+{
+    makeCurrent();
+    mTextures.setMaxBytes(max_bytes);
+}
+
+void MapViewer::setRegistrationCandidates(int candidates_per_image,bool report_recall)
+{
+    mRegistrationCandidates = candidates_per_image;
+    mReportRegistrationRecall = report_recall;
+}
+
+QString MapViewer::textureStatistics() const
+{
+    TextureManager::Statistics s = mTextures.statistics();
+
+    return QString("Textures: %1 own, %2 in %3 atlas pages. %4 MB out of %5 MB. %6 uploads, %7 evictions.")
+            .arg(s.textures).arg(s.atlas_textures).arg(s.atlas_pages).arg(s.bytes/(1024*1024)).arg(s.max_bytes/(1024*1024)).arg(s.uploads).arg(s.evictions);
+}
+
 void MapViewer::setMapAccessor(MapAccessor *ma)
 {
     mMA = ma ;
@@ -240,6 +290,9 @@ void MapViewer::keyPressEvent(QKeyEvent *e)
     case Qt::Key_H: displayHelp();
         break;
 
+    case Qt::Key_V: displayMessage(textureStatistics());
+        break;
+
     case Qt::Key_Down:
     case Qt::Key_Up:
     case Qt::Key_Right:
@@ -270,6 +323,7 @@ void MapViewer::displayHelp()
     text += "    D: compute/show descriptors for current image<br/>";
     text += "    E: display/hide image descriptors<br/>";
     text += "    L: switch to explicit draw mode<br/>";
+    text += "    V: show texture memory usage<br/>";
 
     QMessageBox::information(NULL,"Keys",text);
 }
@@ -382,154 +436,229 @@ void MapViewer::draw()
 	MapDB::ImageSpaceCoord bottomLeftViewCorner(  mCenter.x - mViewScale/2.0, mCenter.y + mViewScale/2.0*aspect_ratio );
 	MapDB::ImageSpaceCoord topRightViewCorner  (  mCenter.x + mViewScale/2.0, mCenter.y - mViewScale/2.0*aspect_ratio );
 
-	mMA->getImagesToDraw(bottomLeftViewCorner,topRightViewCorner,mImagesToDraw);
+	mMA->getImagesToDraw(bottomLeftViewCorner,topRightViewCorner,mImagesToDraw,mViewScale / width(),false,mMaxTextureSize);
+
+	size_t upload_budget = MAX_TEXTURE_UPLOAD_BYTES_PER_FRAME;
+	bool textures_pending = false;
 
 	glPixelTransferf(GL_RED_SCALE  ,1.0) ;
 	glPixelTransferf(GL_GREEN_SCALE,1.0) ;
 	glPixelTransferf(GL_BLUE_SCALE ,1.0) ;
 
 	glDisable(GL_DEPTH_TEST);
+	glDisable(GL_LIGHTING);
 
 	CHECK_GL_ERROR();
 
+	// Only the images crossing the ortho rectangle are drawn, and only their textures are requested/uploaded.
+
+	float view_xmin = mCenter.x - mViewScale/2.0, view_xmax = mCenter.x + mViewScale/2.0;
+	float view_ymin = mCenter.y - mViewScale/2.0*aspect_ratio, view_ymax = mCenter.y + mViewScale/2.0*aspect_ratio;
+
+	mVisibleImages.clear();
+
 	for(uint32_t i=0;i<mImagesToDraw.size();++i)
 	{
-		float image_lon_size = mImagesToDraw[i].W;
-		float image_lat_size = mImagesToDraw[i].H;
+		const MapAccessor::ImageData& img(mImagesToDraw[i]);
 
-		glDisable(GL_LIGHTING);
+		if(img.bottom_left_corner.x <= view_xmax && img.bottom_left_corner.x + img.W >= view_xmin
+		        && img.bottom_left_corner.y <= view_ymax && img.bottom_left_corner.y + img.H >= view_ymin)
+			mVisibleImages.push_back(i);
+	}
 
-        GLuint tex_id = getTextureId(mImagesToDraw[i].handle,mImagesToDraw[i]) ;
+	// Textured quads of all visible images go in a single vertex array (x,y,u,v per vertex), drawn with one call per
+	// run of consecutive images sharing the same texture (i.e. atlas page), so that the drawing order (hence overlaps)
+	// is kept.
 
-		glEnable(GL_TEXTURE_2D);
-		glBindTexture(GL_TEXTURE_2D,tex_id);
+	mTextures.nextFrame();
+	mQuadVertices.clear();
+	mQuadTextures.clear();
 
-		glTexEnvf(GL_TEXTURE_ENV, GL_TEXTURE_ENV_MODE, GL_MODULATE);
+	for(uint32_t k=0;k<mVisibleImages.size();++k)
+	{
+		const MapAccessor::ImageData& img(mImagesToDraw[mVisibleImages[k]]);
+
+		bool up_to_date = true;
+		TextureAtlas::Location loc = getTexture(img.handle,img,upload_budget,up_to_date);
+
+		if(!up_to_date)
+			textures_pending = true;
+
+		mQuadTextures.push_back(loc.texture);
 
-		glBindTexture(GL_TEXTURE_2D,tex_id);
-		CHECK_GL_ERROR();
+		float x0 = img.bottom_left_corner.x, x1 = x0 + img.W;
+		float y0 = img.bottom_left_corner.y, y1 = y0 + img.H;
+
+		const GLfloat quad[16] = { x0,y1,loc.u0,loc.v0,   x1,y1,loc.u1,loc.v0,   x1,y0,loc.u1,loc.v1,   x0,y0,loc.u0,loc.v1 };
+		mQuadVertices.insert(mQuadVertices.end(),quad,quad+16);
+	}
+
+	if(!mQuadTextures.empty())
+	{
+		glEnable(GL_TEXTURE_2D);
+		glTexEnvf(GL_TEXTURE_ENV, GL_TEXTURE_ENV_MODE, GL_MODULATE);
 
 		glEnable(GL_BLEND);
 		glBlendFunc(GL_SRC_ALPHA,GL_ONE_MINUS_SRC_ALPHA);
 
 		glColor3f(1,1,1);
 		glPolygonMode(GL_FRONT_AND_BACK, GL_FILL);
-        glAlphaFunc(GL_GREATER,0.5);
-        glEnable(GL_ALPHA_TEST);
+		glAlphaFunc(GL_GREATER,0.5);
+		glEnable(GL_ALPHA_TEST);
+
+		glEnableClientState(GL_VERTEX_ARRAY);
+		glEnableClientState(GL_TEXTURE_COORD_ARRAY);
+		glVertexPointer  (2,GL_FLOAT,4*sizeof(GLfloat),&mQuadVertices[0]);
+		glTexCoordPointer(2,GL_FLOAT,4*sizeof(GLfloat),&mQuadVertices[2]);
 
-		glBegin(GL_QUADS);
+		for(uint32_t first=0,last;first<mQuadTextures.size();first=last)
+		{
+			for(last=first+1;last<mQuadTextures.size() && mQuadTextures[last] == mQuadTextures[first];++last) ;
 
-		glTexCoord2f(0.0,0.0); glVertex2f( mImagesToDraw[i].bottom_left_corner.x                 , mImagesToDraw[i].bottom_left_corner.y + image_lat_size );
-		glTexCoord2f(1.0,0.0); glVertex2f( mImagesToDraw[i].bottom_left_corner.x + image_lon_size, mImagesToDraw[i].bottom_left_corner.y + image_lat_size );
-		glTexCoord2f(1.0,1.0); glVertex2f( mImagesToDraw[i].bottom_left_corner.x + image_lon_size, mImagesToDraw[i].bottom_left_corner.y                  );
-		glTexCoord2f(0.0,1.0); glVertex2f( mImagesToDraw[i].bottom_left_corner.x                 , mImagesToDraw[i].bottom_left_corner.y                  );
+			glBindTexture(GL_TEXTURE_2D,mQuadTextures[first]);
+			glDrawArrays(GL_QUADS,4*first,4*(last-first));
+		}
 
-		glEnd();
+		glDisableClientState(GL_TEXTURE_COORD_ARRAY);
+		glDisable(GL_ALPHA_TEST);
 		glDisable(GL_TEXTURE_2D);
+	}
+	CHECK_GL_ERROR();
+
+	if(textures_pending && !mRedrawScheduled)
+	{
+		mRedrawScheduled = true;
+		QTimer::singleShot(TEXTURE_POLL_DELAY_MS,this,[this]() { mRedrawScheduled = false; updateGL(); });
+	}
+
+	// Overlays are drawn over all images. The vertex array client state stays enabled until the end of the frame.
+
+	glEnableClientState(GL_VERTEX_ARRAY);
+
+	// Images borders: one call for all the regular borders, then the selected images on top with thicker lines.
 
-		CHECK_GL_ERROR();
+	if(mShowImagesBorder)
+	{
+		mOverlayVertices.clear();
 
-        if(mImagesToDraw[i].handle == mSelectedImage)
+		for(uint32_t k=0;k<mVisibleImages.size();++k)
 		{
-			glLineWidth(5.0);
-			glColor3f(1.0,0.7,0.2) ;
+			const MapAccessor::ImageData& img(mImagesToDraw[mVisibleImages[k]]);
+
+			if(img.handle != mSelectedImage && img.handle != mLastSelectedImage)
+				addRectangleLines(mOverlayVertices,img.bottom_left_corner.x,img.bottom_left_corner.y,img.W,img.H);
 		}
-        else if(mImagesToDraw[i].handle == mLastSelectedImage)
+
+		glLineWidth(1.0);
+		glColor3f(1.0,1.0,1.0);
+		drawLines(mOverlayVertices);
+
+		for(uint32_t k=0;k<mVisibleImages.size();++k)
 		{
+			const MapAccessor::ImageData& img(mImagesToDraw[mVisibleImages[k]]);
+
+			if(img.handle != mSelectedImage && img.handle != mLastSelectedImage)
+				continue;
+
+			mOverlayVertices.clear();
+			addRectangleLines(mOverlayVertices,img.bottom_left_corner.x,img.bottom_left_corner.y,img.W,img.H);
+
 			glLineWidth(5.0);
-			glColor3f(0.7,0.9,0.3) ;
-		}
-		else
-		{
-			glLineWidth(1.0);
-			glColor3f(1.0,1.0,1.0);
-		}
 
-		if(mShowImagesBorder)
-		{
-			glPolygonMode(GL_FRONT_AND_BACK,GL_LINE);
-
-			glBegin(GL_QUADS);
-			glTexCoord2f(0.0,0.0); glVertex2f( mImagesToDraw[i].bottom_left_corner.x                 , mImagesToDraw[i].bottom_left_corner.y + image_lat_size );
-			glTexCoord2f(1.0,0.0); glVertex2f( mImagesToDraw[i].bottom_left_corner.x + image_lon_size, mImagesToDraw[i].bottom_left_corner.y + image_lat_size );
-			glTexCoord2f(1.0,1.0); glVertex2f( mImagesToDraw[i].bottom_left_corner.x + image_lon_size, mImagesToDraw[i].bottom_left_corner.y                  );
-			glTexCoord2f(0.0,1.0); glVertex2f( mImagesToDraw[i].bottom_left_corner.x                 , mImagesToDraw[i].bottom_left_corner.y                  );
-			glEnd();
+			if(img.handle == mSelectedImage)
+				glColor3f(1.0,0.7,0.2) ;
+			else
+				glColor3f(0.7,0.9,0.3) ;
+
+			drawLines(mOverlayVertices);
 		}
+	}
 
-		// now draw file descriptors if any
+	// Descriptor circles only depend on the image descriptors, so they are cached in image coordinates, and placed
+	// with the modelview matrix.
 
-		glLineWidth(5.0);
-		static const int nb_pts = 50 ;
-		int H = mImagesToDraw[i].H;
+	glLineWidth(5.0);
+	glColor3f(1.0,0.0,0.0);
+	glMatrixMode(GL_MODELVIEW);
 
-		for(uint32_t k=0;k<mImagesToDraw[i].descriptors.size();++k)
-		{
-			const MapRegistration::ImageDescriptor& desc(mImagesToDraw[i].descriptors[k]);
-			float radius = mImagesToDraw[i].descriptors[k].pixel_radius;
+	for(uint32_t k=0;k<mVisibleImages.size();++k)
+	{
+		const MapAccessor::ImageData& img(mImagesToDraw[mVisibleImages[k]]);
 
-			glColor3f(1.0,0.0,0.0);
+		if(img.descriptors.empty())
+			continue;
 
-			glBegin(GL_LINE_LOOP) ;
+		const std::vector<GLfloat>& circles(descriptorCircles(img));
 
-			for(int l=0;l<nb_pts;++l)
-				glVertex2f(mImagesToDraw[i].bottom_left_corner.x + (    desc.x+radius*cos(2*M_PI*l/(float)nb_pts)),
-				           mImagesToDraw[i].bottom_left_corner.y + (H-1-desc.y+radius*sin(2*M_PI*l/(float)nb_pts)));
+		glPushMatrix();
+		glTranslatef(img.bottom_left_corner.x,img.bottom_left_corner.y,0.0);
+		drawLines(circles);
+		glPopMatrix();
+	}
 
-			glEnd();
-		}
+	// also draw current descriptor mask around current point of the selected image
+
+	for(uint32_t k=0;k<mVisibleImages.size();++k)
+	{
+		const MapAccessor::ImageData& img(mImagesToDraw[mVisibleImages[k]]);
+
+		if(img.handle != mSelectedImage)
+			continue;
 
-		// also draw current descriptor mask around current point
 		glColor3f(0.7,1.0,0.2);
 
 		glEnable(GL_LINE_SMOOTH) ;
+		glEnable(GL_BLEND);
 		glBlendFunc(GL_ONE_MINUS_SRC_ALPHA,GL_SRC_ALPHA) ;
 
-		glBegin(GL_LINE_LOOP) ;
+		mOverlayVertices.clear();
+		addCircleLines(mOverlayVertices,img.bottom_left_corner.x + mCurrentImageX,img.bottom_left_corner.y + img.H-1-mCurrentImageY,mCurrentDescriptor.pixel_radius);
+		drawLines(mOverlayVertices);
+	}
+	glLineWidth(1.0);
 
-		float radius = mCurrentDescriptor.pixel_radius;
+	CHECK_GL_ERROR();
 
-		for(int l=0;l<nb_pts;++l)
-			glVertex2f(mImagesToDraw[i].bottom_left_corner.x + (    mCurrentImageX+radius*cos(2*M_PI*l/(float)nb_pts)),
-			           mImagesToDraw[i].bottom_left_corner.y + (H-1-mCurrentImageY+radius*sin(2*M_PI*l/(float)nb_pts)));
+    // Draw the reference points, when visible: all circles in one call, then all points in another one.
 
-		glEnd();
-		glLineWidth(1.0);
-	}
-	CHECK_GL_ERROR();
+	glDisable(GL_BLEND);
+	glDisable(GL_LINE_SMOOTH);
 
-    // Draw the reference points
+	static const float reference_point_radius = 100;
+
+	mOverlayVertices.clear();
+	mPointVertices.clear();
 
 	for(int i=0;i<mMA->mapDB().numberOfReferencePoints();++i)
 	{
-        glLineWidth(3.0);
-        glDisable(GL_BLEND);
-        glDisable(GL_LINE_SMOOTH);
-
 		const MapDB::ReferencePoint& p = mMA->mapDB().getReferencePoint(i);
 		MapDB::RegisteredImage img;
 
         mMA->getImageParams(p.handle,img);
 
-		float radius = 100;
-		int nb_pts = 50;
+		float x = p.x + img.bottom_left_corner.x;
+		float y = (img.H-1-p.y) + img.bottom_left_corner.y;
 
-		glColor3f(0.1,0.3,0.9);
-		glLineWidth(3.0);
-		glBegin(GL_LINE_LOOP);
+		if(x + reference_point_radius < view_xmin || x - reference_point_radius > view_xmax || y + reference_point_radius < view_ymin || y - reference_point_radius > view_ymax)
+			continue;
+
+		addCircleLines(mOverlayVertices,x,y,reference_point_radius);
 
-		for(int l=0;l<nb_pts;++l)
-			glVertex2f(         p.x  + img.bottom_left_corner.x + radius*cos(2*M_PI*l/(float)nb_pts),
-			           (img.H-1-p.y) + img.bottom_left_corner.y + radius*sin(2*M_PI*l/(float)nb_pts));
+		mPointVertices.push_back(x);
+		mPointVertices.push_back(y);
+	}
 
-		glEnd();
+	if(!mPointVertices.empty())
+	{
+		glColor3f(0.1,0.3,0.9);
+		glLineWidth(3.0);
+		drawLines(mOverlayVertices);
 
 		glEnable(GL_POINT_SMOOTH);
 		glPointSize(10.0);
 
-		glBegin(GL_POINTS);
-		glVertex2f(p.x + img.bottom_left_corner.x, (img.H-1-p.y) + img.bottom_left_corner.y);
-		glEnd();
+		glVertexPointer(2,GL_FLOAT,0,&mPointVertices[0]);
+		glDrawArrays(GL_POINTS,0,mPointVertices.size()/2);
 	}
 	CHECK_GL_ERROR();
 
@@ -538,71 +667,140 @@ void MapViewer::draw()
     if(mShowExportGrid)
 	{
         glLineWidth(3.0);
-        glDisable(GL_BLEND);
-        glDisable(GL_LINE_SMOOTH);
 
 		MapDB::ImageSpaceCoord top_left_corner,bottom_right_corner;
 
 		screenCoordinatesToImageSpaceCoordinates(0,0,top_left_corner);
 		screenCoordinatesToImageSpaceCoordinates(width()-1,height()-1,bottom_right_corner);
 
-		glColor3d(0.7,0.2,0.3);
-		glBegin(GL_LINES);
+		mOverlayVertices.clear();
 
 		for(float x=top_left_corner.x;x<bottom_right_corner.x; x+=1024)
 		{
-			glVertex2f(x,top_left_corner.y);
-			glVertex2f(x,bottom_right_corner.y);
+			const GLfloat line[4] = { x,top_left_corner.y, x,bottom_right_corner.y };
+			mOverlayVertices.insert(mOverlayVertices.end(),line,line+4);
 		}
 		for(float y=bottom_right_corner.y;y<top_left_corner.y; y+=1024)
 		{
-			glVertex2f(top_left_corner.x,y);
-			glVertex2f(bottom_right_corner.x,y);
+			const GLfloat line[4] = { top_left_corner.x,y, bottom_right_corner.x,y };
+			mOverlayVertices.insert(mOverlayVertices.end(),line,line+4);
 		}
-		glEnd();
+
+		glColor3d(0.7,0.2,0.3);
+		drawLines(mOverlayVertices);
 	}
 
+	glDisableClientState(GL_VERTEX_ARRAY);
+	glLineWidth(1.0);
+
 	CHECK_GL_ERROR();
 }
 
-GLuint MapViewer::getTextureId(MapDB::ImageHandle h, const MapAccessor::ImageData& img_data)
+// Overlay geometry is built as GL_LINES segments (x,y per vertex), so that any number of borders or circles can be
+// drawn in a single call.
+
+static const int CIRCLE_NB_PTS = 50;
+
+static const std::vector<GLfloat>& unitCircle()
 {
-    static std::map<MapDB::ImageHandle,GLuint> ids ;
+    static std::vector<GLfloat> pts;
 
-    auto it = ids.find(h) ;
+    if(pts.empty())
+        for(int l=0;l<CIRCLE_NB_PTS;++l)
+        {
+            pts.push_back(cos(2*M_PI*l/(float)CIRCLE_NB_PTS));
+            pts.push_back(sin(2*M_PI*l/(float)CIRCLE_NB_PTS));
+        }
 
-	if(it == ids.end())
-	{
-		GLuint tex_id = 0;
-		glGenTextures(1,&tex_id);
+    return pts;
+}
+
+void MapViewer::addCircleLines(std::vector<GLfloat>& vertices,float cx,float cy,float radius)
+{
+    const std::vector<GLfloat>& pts(unitCircle());
+
+    for(int l=0;l<CIRCLE_NB_PTS;++l)
+    {
+        int m = (l+1) % CIRCLE_NB_PTS;
 
-        ids[h] = tex_id ;
+        const GLfloat segment[4] = { cx + radius*pts[2*l], cy + radius*pts[2*l+1], cx + radius*pts[2*m], cy + radius*pts[2*m+1] };
+        vertices.insert(vertices.end(),segment,segment+4);
+    }
+}
 
-		glBindTexture(GL_TEXTURE_2D,tex_id);
-		glPixelStorei(GL_UNPACK_ALIGNMENT,4);
-		glPixelStorei(GL_PACK_ALIGNMENT ,4);
+void MapViewer::addRectangleLines(std::vector<GLfloat>& vertices,float x,float y,float W,float H)
+{
+    const GLfloat segments[16] = { x,y, x+W,y,   x+W,y, x+W,y+H,   x+W,y+H, x,y+H,   x,y+H, x,y };
+    vertices.insert(vertices.end(),segments,segments+16);
+}
 
-		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S    , GL_CLAMP);
-		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T    , GL_CLAMP);
-		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_R    , GL_CLAMP);
+void MapViewer::drawLines(const std::vector<GLfloat>& vertices)
+{
+    if(vertices.empty())
+        return;
 
-		glEnable(GL_TEXTURE_2D);
-        glEnable(GL_BLEND);
-		glTexImage2D(GL_TEXTURE_2D,0,GL_RGBA8,1024,1024,0,GL_RGBA,GL_UNSIGNED_BYTE,img_data.texture_data);
-		glDisable(GL_TEXTURE_2D);
+    glVertexPointer(2,GL_FLOAT,0,&vertices[0]);
+    glDrawArrays(GL_LINES,0,vertices.size()/2);
+}
 
-		CHECK_GL_ERROR();
+// Circles are rebuilt when the descriptors of the image change, which is detected from their positions and sizes.
 
-        std::cerr << "Allocating new texture ID " << tex_id << " for texture " << h << std::endl;
+const std::vector<GLfloat>& MapViewer::descriptorCircles(const MapAccessor::ImageData& img)
+{
+    uint64_t signature = img.H;
 
-        return tex_id;
-	}
-	else
-		return it->second;
+    for(uint32_t k=0;k<img.descriptors.size();++k)
+        signature = signature*1000003 + ((uint64_t(uint32_t(img.descriptors[k].x)) << 40) ^ (uint64_t(uint32_t(img.descriptors[k].y)) << 16) ^ uint32_t(img.descriptors[k].pixel_radius));
+
+    DescriptorCircles& c(mDescriptorCircles[img.handle]);
+
+    if(c.signature != signature || c.vertices.empty())
+    {
+        c.signature = signature;
+        c.vertices.clear();
+
+        for(uint32_t k=0;k<img.descriptors.size();++k)
+        {
+            const MapRegistration::ImageDescriptor& desc(img.descriptors[k]);
+            addCircleLines(c.vertices,desc.x,img.H-1-desc.y,desc.pixel_radius);
+        }
+    }
+
+    return c.vertices;
 }
 
+// While the texture at the requested resolution is not ready, or when the upload budget of the frame is spent, the
+// texture previously uploaded for the image is returned instead (or the placeholder texture if there is none), and
+// up_to_date is set to false.
+
+TextureAtlas::Location MapViewer::getTexture(MapDB::ImageHandle h, const MapAccessor::ImageData& img_data,size_t& upload_budget,bool& up_to_date)
+{
+    TextureAtlas::Location loc;
+    int W = 0, H = 0;
+    bool found = mTextures.find(h,loc,W,H);
+
+    if(found && W == img_data.texture_W && H == img_data.texture_H && img_data.texture_data != NULL)
+        return loc;
+
+    // At least one texture is uploaded per frame, whatever its size.
+
+    size_t bytes = 4*size_t(img_data.texture_W)*img_data.texture_H;
+
+    if(img_data.texture_data == NULL || (bytes > upload_budget && upload_budget < MAX_TEXTURE_UPLOAD_BYTES_PER_FRAME))
+    {
+        up_to_date = false;
+        return found ? loc : mTextures.placeholder();
+    }
+    upload_budget -= std::min(bytes,upload_budget);
+
+    // The texture resolution follows the zoom level, so existing textures are re-uploaded when it changes.
+
+    loc = mTextures.upload(h,img_data.texture_data,img_data.texture_W,img_data.texture_H);
+
+    CHECK_GL_ERROR();
+
+    return loc;
+}
 
 void MapViewer::forceUpdate()
 {
@@ -628,14 +826,14 @@ void MapViewer::mouseReleaseEvent(QMouseEvent *e)
     QGLViewer::mouseReleaseEvent(e);
 }
 
-// This code cannot use the similar function in MapDB because eventualy it will request less images so the search will be faster than searching in the whole DB.
+// The search goes through the spatial index of the MapAccessor, so it only visits the images around the given point.
 
 bool MapViewer::screenPositionToSingleImagePixelPosition(int px, int py, float& img_x, float& img_y, MapDB::ImageHandle &h)
 {
 	MapDB::ImageSpaceCoord is;
 	screenCoordinatesToImageSpaceCoordinates(px,py,is);
 
-    return mMA->findImagePixel(is,mImagesToDraw,img_x,img_y,h) ;
+    return mMA->findImagePixel(is,img_x,img_y,h) ;
 }
 
 void MapViewer::screenCoordinatesToImageSpaceCoordinates(int i,int j,MapDB::ImageSpaceCoord& is) const
@@ -849,7 +1047,7 @@ void MapViewer::computeAllPositions()
     for(auto it(images_map.begin());it!=images_map.end();++it)
     	images_full_paths.push_back(mMA->fullPath(it->first).toStdString());
 
-    if(! MapRegistration::computeAllImagesPositions(mMA->imageMask(),images_full_paths,coords))
+    if(! MapRegistration::computeAllImagesPositions(mMA->imageMask(),images_full_paths,coords,mRegistrationCandidates,mReportRegistrationRecall))
     {
         std::cerr << "No global transform found!" << std::endl;
         return;
@@ -1,5 +1,6 @@
 #include "MapDB.h"
 #include "MapAccessor.h"
+#include "TextureManager.h"
 #include <QGLViewer/qglviewer.h>
 
 class MapAccessor;
@@ -8,10 +9,14 @@ class MapViewer: public QGLViewer
 {
 public:
 	MapViewer(QWidget *parent) ;
+    virtual ~MapViewer();
 
     void setMapAccessor(MapAccessor *ma);
+    void setTextureMemory(size_t max_bytes);
+    void setRegistrationCandidates(int candidates_per_image, bool report_recall);
 
 	virtual void draw() override ;
+	virtual void init() override ;
 
 	void forceUpdate();
 
@@ -20,10 +25,11 @@ protected:
 	void updateSlice();
 	void exportMap();
 	void displayHelp();
+	QString textureStatistics() const;
 
 	void dropEvent(QDropEvent *event) override;
 	void dragEnterEvent(QDragEnterEvent *event) override;
-    GLuint getTextureId(MapDB::ImageHandle h,const MapAccessor::ImageData& img_data) ;
+    TextureAtlas::Location getTexture(MapDB::ImageHandle h,const MapAccessor::ImageData& img_data,size_t& upload_budget,bool& up_to_date) ;
 	void screenCoordinatesToImageSpaceCoordinates(int i, int j, MapDB::ImageSpaceCoord &is) const;
 	void computeDescriptorsForCurrentImage();
 	void computeRelatedTransform();
@@ -32,6 +38,12 @@ protected:
     bool screenPositionToSingleImagePixelPosition(int px, int py, float &img_x, float &img_y, MapDB::ImageHandle& h);
 	void moveFromKeyboard(int key);
 
+    const std::vector<GLfloat>& descriptorCircles(const MapAccessor::ImageData& img);
+
+    static void addCircleLines(std::vector<GLfloat>& vertices, float cx, float cy, float radius);
+    static void addRectangleLines(std::vector<GLfloat>& vertices, float x, float y, float W, float H);
+    static void drawLines(const std::vector<GLfloat>& vertices);
+
 	virtual void resizeEvent(QResizeEvent *) override;
 	virtual void wheelEvent(QWheelEvent *e) override;
 	virtual void mouseMoveEvent(QMouseEvent *e) override;
@@ -52,6 +64,7 @@ protected:
     bool mMovingSelected;
     bool mShowImagesBorder;
     bool mShowExportGrid;
+    bool mRedrawScheduled;	// a redraw is scheduled to pick up the textures loaded in the background
 
     MapRegistration::ImageDescriptor mCurrentDescriptor ;
 
@@ -65,6 +78,29 @@ protected:
     MapAccessor *mMA;
 	std::vector<MapAccessor::ImageData> mImagesToDraw;
 
+    // Geometry of the current frame. Kept as members so that their memory is reused from one frame to the next.
+
+    std::vector<uint32_t> mVisibleImages;	// indices in mImagesToDraw of the images crossing the view
+    std::vector<GLfloat>  mQuadVertices;	// textured quads of the visible images: x,y,u,v per vertex
+    std::vector<GLuint>   mQuadTextures;	// texture of each quad
+    std::vector<GLfloat>  mOverlayVertices;	// lines: x,y per vertex
+    std::vector<GLfloat>  mPointVertices;
+
+    struct DescriptorCircles
+    {
+        DescriptorCircles() : signature(0) {}
+
+        uint64_t signature;				// identifies the descriptors the circles were built for
+        std::vector<GLfloat> vertices;	// lines, relative to the bottom left corner of the image
+    };
+    std::map<MapDB::ImageHandle,DescriptorCircles> mDescriptorCircles;
+
+    TextureManager mTextures;
+    GLint mMaxTextureSize;		// GL_MAX_TEXTURE_SIZE of the current context
+
+    int  mRegistrationCandidates;		// images matched with each image when computing all positions. 0 = all.
+    bool mReportRegistrationRecall;
+
     MapDB::ImageSpaceCoord mCenter;
 };
 
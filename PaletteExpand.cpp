@@ -0,0 +1,80 @@
+#include <string.h>
+
+#include "PaletteExpand.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define PALETTE_EXPAND_AVX2
+#include <immintrin.h>
+#endif
+
+static void expandPaletteScalar(const unsigned char *src, const uint32_t *palette, uint32_t *dst, size_t n)
+{
+    size_t i=0;
+
+    for(;i+4<=n;i+=4)
+    {
+        dst[i+0] = palette[src[i+0]];
+        dst[i+1] = palette[src[i+1]];
+        dst[i+2] = palette[src[i+2]];
+        dst[i+3] = palette[src[i+3]];
+    }
+    for(;i<n;++i)
+        dst[i] = palette[src[i]];
+}
+
+#ifdef PALETTE_EXPAND_AVX2
+__attribute__((target("avx2")))
+static void expandPaletteAVX2(const unsigned char *src, const uint32_t *palette, uint32_t *dst, size_t n)
+{
+    size_t i=0;
+    const int *table = reinterpret_cast<const int*>(palette);
+
+    // 8 indices are widened to 32 bits, then used to gather 8 palette entries at once.
+
+    for(;i+16<=n;i+=16)
+    {
+        __m128i idx = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src+i));
+
+        __m256i lo = _mm256_i32gather_epi32(table,_mm256_cvtepu8_epi32(idx),4);
+        __m256i hi = _mm256_i32gather_epi32(table,_mm256_cvtepu8_epi32(_mm_srli_si128(idx,8)),4);
+
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(dst+i  ),lo);
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(dst+i+8),hi);
+    }
+
+    expandPaletteScalar(src+i,palette,dst+i,n-i);
+}
+#endif
+
+void expandPalette(const unsigned char *src, const uint32_t *palette, uint32_t *dst, size_t n)
+{
+#ifdef PALETTE_EXPAND_AVX2
+    static const bool has_avx2 = __builtin_cpu_supports("avx2");
+
+    if(has_avx2)
+        return expandPaletteAVX2(src,palette,dst,n);
+#endif
+    expandPaletteScalar(src,palette,dst,n);
+}
+
+void expandPalette(const unsigned char *src, int src_stride, const uint32_t *palette, uint32_t *dst, int dst_stride, int W, int H)
+{
+    if(src_stride == W && dst_stride == 4*W)
+        return expandPalette(src,palette,dst,size_t(W)*H);
+
+    for(int j=0;j<H;++j)
+        expandPalette(src + size_t(src_stride)*j,palette,reinterpret_cast<uint32_t*>(reinterpret_cast<unsigned char*>(dst) + size_t(dst_stride)*j),W);
+}
+
+void paletteToRGBA(const uint32_t *palette, uint32_t *out)
+{
+    // 0xAARRGGBB -> bytes R,G,B,A in memory, whatever the endianness
+
+    for(int i=0;i<256;++i)
+    {
+        uint32_t c = palette[i];
+        const unsigned char rgba[4] = { (unsigned char)(c >> 16), (unsigned char)(c >> 8), (unsigned char)c, (unsigned char)(c >> 24) };
+
+        memcpy(&out[i],rgba,4);
+    }
+}
@@ -0,0 +1,20 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+// Conversion of 8-bit palette indices into 32-bit pixels.
+//
+// Palette images (such as QCT tiles) are kept indexed as long as possible, since they take 4 times less memory
+// than their RGB counterpart, and only expanded when the actual colours are needed (e.g. texture upload).
+// The expansion uses AVX2 gathers when the CPU supports it, and an unrolled scalar loop otherwise.
+
+// dst[i] = palette[src[i]] for i in [0,n). The palette must have 256 entries.
+void expandPalette(const unsigned char *src, const uint32_t *palette, uint32_t *dst, size_t n);
+
+// Same as expandPalette(), but for an image with W x H pixels, which lines are src_stride and dst_stride bytes apart.
+void expandPalette(const unsigned char *src, int src_stride, const uint32_t *palette, uint32_t *dst, int dst_stride, int W, int H);
+
+// Fills out[256] with the palette colours in the byte order expected by OpenGL for GL_RGBA/GL_UNSIGNED_BYTE,
+// from a QRgb palette (0xAARRGGBB).
+void paletteToRGBA(const uint32_t *palette, uint32_t *out);
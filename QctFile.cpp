@@ -0,0 +1,146 @@
+#include <stdexcept>
+#include <string.h>
+#include <errno.h>
+#include <algorithm>
+
+#include "QctFile.h"
+
+QctFile::QctFile(const std::string& filename,QctReader::AccessMode mode)
+{
+    if(!mReader.open(filename,mode))
+        throw std::runtime_error("Cannot open QCT file " + filename + ": " + strerror(errno));
+
+    QctReader::Cursor c = mReader.cursor(0);
+
+    if(uint32_t(c.readInt()) != QctReader::MAGIC)
+        throw std::runtime_error("File " + filename + " is not a QCT file.");
+
+    c.readInt();	// version
+    mWidth  = c.readInt();
+    mHeight = c.readInt();
+
+    if(mWidth <= 0 || mHeight <= 0)
+        throw std::runtime_error("File " + filename + ": inconsistent map size.");
+
+    // Datum shift, which lives in the extended metadata (pointer in header word 21)
+
+    c.seek(21*4);
+    c.seek(uint32_t(c.readInt()) + 4);
+    c.seek(uint32_t(c.readInt()));
+
+    datum_shift_north = c.readDouble();
+    datum_shift_east  = c.readDouble();
+
+    // Georeferencing coefficients. We only need the pixel to lat/lon ones, which come after the 20 easting/northing ones.
+
+    c.seek(QctReader::GEOREF_OFFSET + 20*8);
+
+    lat = c.readDouble(); latX = c.readDouble(); latY = c.readDouble(); latXX = c.readDouble(); latXY = c.readDouble();
+    latYY = c.readDouble(); latXXX = c.readDouble(); latXXY = c.readDouble(); latXYY = c.readDouble(); latYYY = c.readDouble();
+
+    lon = c.readDouble(); lonX = c.readDouble(); lonY = c.readDouble(); lonXX = c.readDouble(); lonXY = c.readDouble();
+    lonYY = c.readDouble(); lonXXX = c.readDouble(); lonXXY = c.readDouble(); lonXYY = c.readDouble(); lonYYY = c.readDouble();
+
+    // Palette
+
+    c.seek(QctReader::PALETTE_OFFSET);
+
+    for(int i=0;i<256;++i)
+        mPalette[i] = c.readInt();
+
+    mColorTable.resize(256);
+
+    for(int i=0;i<256;++i)
+        mColorTable[i] = 0xff000000 | mPalette[i];
+
+    // Tile index. Kept in memory so that any tile can be reached directly.
+
+    mTileIndex.resize(size_t(mWidth)*mHeight);
+
+    if(mReader.size() < QctReader::INDEX_OFFSET + 4*uint64_t(mTileIndex.size()))
+        throw std::runtime_error("File " + filename + ": truncated tile index.");
+
+    c.seek(QctReader::INDEX_OFFSET);
+
+    for(size_t i=0;i<mTileIndex.size();++i)
+        mTileIndex[i] = c.readInt();
+
+    // When the file is read rather than mapped, the data of a tile ends at the latest where the next tile starts: that
+    // is all there is to read to decode it.
+
+    if(mReader.mode() == QctReader::ACCESS_PREAD)
+    {
+        mSortedTileOffsets = mTileIndex;
+        std::sort(mSortedTileOffsets.begin(),mSortedTileOffsets.end());
+        mSortedTileOffsets.erase(std::unique(mSortedTileOffsets.begin(),mSortedTileOffsets.end()),mSortedTileOffsets.end());
+    }
+}
+
+bool QctFile::decodeTile(int tile_x,int tile_y,unsigned char *dst,int stride) const
+{
+    if(tile_x < 0 || tile_x >= mWidth || tile_y < 0 || tile_y >= mHeight)
+        return false;
+
+    uint32_t offset = mTileIndex[tile_x + size_t(mWidth)*tile_y];
+    auto next = std::upper_bound(mSortedTileOffsets.begin(),mSortedTileOffsets.end(),offset);
+
+    if(next == mSortedTileOffsets.end())	// mapped file, or last tile of the file
+    {
+        QctReader::Cursor c = mReader.cursor(offset);
+        return QctReader::decodeTile(c,dst,stride);
+    }
+
+    QctReader::Cursor c = mReader.cursor(offset,*next - offset);
+
+    return QctReader::decodeTile(c,dst,stride);
+}
+
+QImage QctFile::getTileImage(int tile_x,int tile_y) const
+{
+    if(tile_x < 0 || tile_x >= mWidth || tile_y < 0 || tile_y >= mHeight)
+        return QImage();
+
+    QImage img(QCT_TILE_SIZE,QCT_TILE_SIZE,QImage::Format_Indexed8);
+    img.setColorTable(mColorTable);
+
+    decodeTile(tile_x,tile_y,img.bits(),img.bytesPerLine());
+
+    return img;
+}
+
+/* -------------------------------------------------------------------------
+ * Convert pixel (x,y) in image into (longitude,latitude)
+ * x,y from top left
+ * latitude,longitude in degrees WGS84.
+ * clips out of range x,y rather than blindly converting.
+ */
+void QctFile::xy_to_latlon(int x, int y, double& latitude, double& longitude) const
+{
+    if (x<0) x=0;
+    if (y<0) y=0;
+    if (x>=mWidth*QCT_TILE_SIZE) x=mWidth*QCT_TILE_SIZE-1;
+    if (y>=mHeight*QCT_TILE_SIZE) y=mHeight*QCT_TILE_SIZE;
+
+    double x2 = double(x) * x;
+    double x3 = x2 * x;
+    double y2 = double(y) * y;
+    double y3 = y2 * y;
+
+    longitude = lon + lonX * x + lonY * y + lonXX * x2 + lonXY * x * y + lonYY * y2 + lonXXX * x3 + lonXXY * x2 * y + lonXYY * x * y2 + lonYYY * y3;
+    latitude  = lat + latX * x + latY * y + latXX * x2 + latXY * x * y + latYY * y2 + latXXX * x3 + latXXY * x2 * y + latXYY * x * y2 + latYYY * y3;
+
+    // Add the datum shift
+    longitude += datum_shift_east;
+    latitude  += datum_shift_north;
+}
+
+void QctFile::computeLatLonLimits(double& lat_00, double& lon_00,
+                                  double& lat_10, double& lon_10,
+                                  double& lat_01, double& lon_01,
+                                  double& lat_11, double& lon_11 ) const
+{
+    xy_to_latlon(0                      , 0                       , lat_01, lon_01);
+    xy_to_latlon(mWidth*QCT_TILE_SIZE   , 0                       , lat_11, lon_11);
+    xy_to_latlon(0                      , mHeight*QCT_TILE_SIZE   , lat_00, lon_00);
+    xy_to_latlon(mWidth*QCT_TILE_SIZE   , mHeight*QCT_TILE_SIZE   , lat_10, lon_10);
+}
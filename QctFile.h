@@ -0,0 +1,61 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <QImage>
+#include <QVector>
+
+#include "QctReader.h"
+
+// Read access to the tiles and georeferencing of a QCT map file.
+//
+// The file is opened once and kept open: headers and the tile index are parsed at construction, and tiles
+// are decoded on demand straight from the file content (memory-mapped by default). Decoding a tile costs a
+// single seek to its data, whatever its position in the map.
+
+class QctFile
+{
+public:
+    static const int QCT_TILE_SIZE = QctReader::TILE_SIZE;
+
+    QctFile(const std::string& filename, QctReader::AccessMode mode = QctReader::ACCESS_MMAP) ;
+
+    int sizeX() const { return mWidth ; }	// size in tiles
+    int sizeY() const { return mHeight; }
+
+    const int *palette() const { return mPalette; }	// combined RGB in each int, blue is LSB
+    const QVector<QRgb>& colorTable() const { return mColorTable; }	// same as palette(), as opaque QRgb for QImage::Format_Indexed8
+
+    // compute latitude/longitude of the four corners
+
+    void computeLatLonLimits(double& lat_00, double& lon_00,
+                             double& lat_10, double& lon_10,
+                             double& lat_01, double& lon_01,
+                             double& lat_11, double& lon_11 ) const;
+
+    // Decodes tile (tile_x,tile_y) as palette indices into dst, which rows are separated by stride bytes. The
+    // tile occupies QCT_TILE_SIZE rows of QCT_TILE_SIZE bytes. Returns false if the tile is outside of the map
+    // or its data is inconsistent, in which case dst is left untouched or blank respectively.
+
+    bool decodeTile(int tile_x,int tile_y,unsigned char *dst,int stride) const;
+
+    // Returns the tile as a QImage::Format_Indexed8 image, using colorTable().
+
+    QImage getTileImage(int tile_x,int tile_y) const;
+
+private:
+    void xy_to_latlon(int x, int y, double& latitude, double& longitude) const;
+
+    QctReader mReader;
+
+    int mWidth, mHeight;	// size in tiles (of 64x64 each)
+    int mPalette[256];
+    QVector<QRgb> mColorTable;
+    std::vector<uint32_t> mTileIndex;	// file offset of each tile, row by row
+    std::vector<uint32_t> mSortedTileOffsets;	// tile offsets in increasing order, only when the file is not mapped
+
+    // Georeferencing coefficients
+    double lat, latX, latY, latXX, latXY, latYY, latXXX, latXXY, latXYY, latYYY;
+    double lon, lonX, lonY, lonXX, lonXY, lonYY, lonXXX, lonXXY, lonXYY, lonYYY;
+    double datum_shift_north, datum_shift_east;
+};
@@ -7,8 +7,8 @@
 
 #define NOT_IMPLEMENTED std::cerr << __PRETTY_FUNCTION__ << ": not implemented yet."
 
-QctMapDB::QctMapDB(const QString& name)
-    : MapDB(name), mQctFile(name.toStdString())
+QctMapDB::QctMapDB(const QString& name,size_t tile_cache_size)
+    : MapDB(name), mQctFile(name.toStdString()), mTileCache(tile_cache_size)
 {
     if(!QFile(name).exists())
         throw std::runtime_error("Specified file " + name.toStdString() + " is not present on disk.");
@@ -46,6 +46,14 @@ QctMapDB::QctMapDB(const QString& name)
         }
 }
 
+QctMapDB::~QctMapDB()
+{
+    QctTileCache::Statistics s = mTileCache.statistics();
+
+    std::cerr << "Tile cache: " << s.hits << " hits, " << s.misses << " misses, " << s.evictions << " evictions. "
+              << s.entries << " tiles in cache (" << s.bytes/1024 << " KB out of " << s.max_bytes/1024 << " KB)" << std::endl;
+}
+
 const std::map<MapDB::ImageHandle,MapDB::RegisteredImage>& QctMapDB::getFullListOfImages() const
 {
     return mImages;
@@ -58,10 +66,45 @@ bool QctMapDB::getImageParams(ImageHandle h, MapDB::RegisteredImage& img) const
 }
 QImage QctMapDB::getImageData(ImageHandle h) const
 {
-    int x,y;
+    QByteArray data = getTileData(h);
+
+    if(data.isEmpty())
+        return QImage();
+
+    // The image directly uses the cached pixels: it holds a reference on them until it is destroyed, so that
+    // eviction from the cache never invalidates it. Tiles stay palette-indexed, and all share the same colour table.
+
+    QImage img(reinterpret_cast<const uchar*>(data.constData()),QctFile::QCT_TILE_SIZE,QctFile::QCT_TILE_SIZE,QctFile::QCT_TILE_SIZE,
+               QImage::Format_Indexed8,releaseTileData,new QByteArray(data));
+
+    img.setColorTable(mQctFile.colorTable());
+
+    return img;
+}
+
+void QctMapDB::releaseTileData(void *data)
+{
+    delete static_cast<QByteArray*>(data);
+}
+
+QByteArray QctMapDB::getTileData(ImageHandle h) const
+{
+    QByteArray data;
+
+    if(mTileCache.find(h,data))
+        return data;
 
     auto p = handleToCoordinates(h);
-    return mQctFile.getTileImage(p.first,p.second);
+
+    if(p.first < 0 || p.first >= mQctFile.sizeX() || p.second < 0 || p.second >= mQctFile.sizeY())
+        return QByteArray();
+
+    data = QByteArray(QctFile::QCT_TILE_SIZE*QctFile::QCT_TILE_SIZE,0);
+    mQctFile.decodeTile(p.first,p.second,reinterpret_cast<unsigned char*>(data.data()),QctFile::QCT_TILE_SIZE);
+
+    mTileCache.insert(h,data);
+
+    return data;
 }
 bool QctMapDB::imageSpaceCoordinatesToGPSCoordinates(const MapDB::ImageSpaceCoord& ic,MapDB::GPSCoord& g) const
 {
@@ -79,7 +122,7 @@ int QctMapDB::numberOfReferencePoints() const { return 0 ; }
 
 std::pair<int,int> QctMapDB::handleToCoordinates(ImageHandle h) const
 {
-    return std::make_pair( int(h)%mQctFile.sizeX(), int(h)/mQctFile.sizeY());
+    return std::make_pair( int(h)%mQctFile.sizeX(), int(h)/mQctFile.sizeX());
 }
 
 MapDB::ImageHandle QctMapDB::coordinatesToHandle(int x,int y) const
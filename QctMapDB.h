@@ -1,6 +1,7 @@
 #pragma once
 
 #include "QctFile.h"
+#include "QctTileCache.h"
 #include "MapDB.h"
 
  // Manages a collection of maps represented by a single QCT file
@@ -8,8 +9,8 @@
 class QctMapDB : public MapDB
 {
 public:
-        QctMapDB(const QString& qct_filename) ; // initializes the map. Loads the registered images entries from xml file.
-        virtual ~QctMapDB() {}
+        QctMapDB(const QString& qct_filename,size_t tile_cache_size = QctTileCache::DEFAULT_MAX_BYTES) ; // initializes the map. Loads the registered images entries from xml file.
+        virtual ~QctMapDB() ;
 
         virtual const std::map<ImageHandle,MapDB::RegisteredImage>& getFullListOfImages() const override ;
         virtual bool getImageParams(ImageHandle h, MapDB::RegisteredImage& img) const override;
@@ -18,10 +19,18 @@ public:
         virtual const ReferencePoint& getReferencePoint(int i) const override;
         virtual int numberOfReferencePoints() const override;
 
+        QctTileCache::Statistics tileCacheStatistics() const { return mTileCache.statistics(); }
+
 private:
         std::pair<int,int> handleToCoordinates(ImageHandle h) const;
         ImageHandle coordinatesToHandle(int x,int y) const;
+
+        // Returns the palette indices of the given tile, from the cache when possible. Thread-safe.
+        QByteArray getTileData(ImageHandle h) const;
+        static void releaseTileData(void *data);	// QImage cleanup function for images built on cached tile data
+
         std::map<MapDB::ImageHandle,MapDB::RegisteredImage> mImages;
 
         mutable QctFile mQctFile;
+        mutable QctTileCache mTileCache;	// decoded tiles, shared by all readers
 };
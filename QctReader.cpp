@@ -0,0 +1,508 @@
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <algorithm>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "QctReader.h"
+
+/* -------------------------------------------------------------------------
+ * File access
+ */
+
+QctReader::QctReader()
+    : mFd(-1),mMode(ACCESS_MMAP),mSize(0),mMappedData(NULL)
+{
+}
+
+QctReader::~QctReader()
+{
+    close();
+}
+
+bool QctReader::open(const std::string& filename,AccessMode mode)
+{
+    close();
+
+    mFd = ::open(filename.c_str(),O_RDONLY);
+
+    if(mFd < 0)
+        return false;
+
+    struct stat st;
+
+    if(fstat(mFd,&st) != 0)
+    {
+        close();
+        return false;
+    }
+    mSize = st.st_size;
+    mMode = mode;
+
+    if(mMode == ACCESS_MMAP && mSize > 0)
+    {
+        void *data = mmap(NULL,mSize,PROT_READ,MAP_PRIVATE,mFd,0);
+
+        if(data == MAP_FAILED)
+            mMode = ACCESS_PREAD;	// e.g. 32 bits address space exhausted. Keep going with plain reads.
+        else
+            mMappedData = static_cast<const unsigned char*>(data);
+    }
+    else
+        mMode = ACCESS_PREAD;
+
+    return true;
+}
+
+void QctReader::close()
+{
+    if(mMappedData != NULL)
+        munmap(const_cast<unsigned char*>(mMappedData),mSize);
+
+    if(mFd >= 0)
+        ::close(mFd);
+
+    mMappedData = NULL;
+    mFd = -1;
+    mSize = 0;
+}
+
+size_t QctReader::readAt(uint64_t offset,unsigned char *buf,size_t len) const
+{
+    size_t total = 0;
+
+    while(total < len)
+    {
+        ssize_t n = pread(mFd,buf+total,len-total,offset+total);
+
+        if(n <= 0)
+            break;
+
+        total += n;
+    }
+    return total;
+}
+
+const char *QctReader::modeName(AccessMode mode)
+{
+    switch(mode)
+    {
+    case ACCESS_MMAP:  return "mmap";
+    case ACCESS_PREAD: return "pread";
+    }
+    return "unknown";
+}
+
+bool QctReader::parseMode(const char *name,AccessMode& mode)
+{
+    if(!strcmp(name,"mmap"))  { mode = ACCESS_MMAP ; return true; }
+    if(!strcmp(name,"pread")) { mode = ACCESS_PREAD; return true; }
+
+    return false;
+}
+
+/* -------------------------------------------------------------------------
+ * Cursor
+ */
+
+QctReader::Cursor::Cursor(const QctReader& reader,uint64_t offset,size_t buffer_size)
+    : mReader(reader),mBegin(NULL),mPtr(NULL),mEnd(NULL),mBufferOffset(0),mBufferSize(std::max(size_t(1),buffer_size))
+{
+    seek(offset);
+}
+
+void QctReader::Cursor::seek(uint64_t offset)
+{
+    if(mReader.mMappedData != NULL)
+    {
+        // The window is the whole file, so that getByte() never needs to refill.
+
+        if(offset > mReader.mSize)
+            offset = mReader.mSize;
+
+        mBegin = mReader.mMappedData;
+        mEnd   = mReader.mMappedData + mReader.mSize;
+        mPtr   = mBegin + offset;
+        mBufferOffset = 0;
+        return;
+    }
+
+    // Seeking inside the current buffer is free. Otherwise, leave the buffer empty and let refill() do the job.
+
+    if(mBegin != NULL && offset >= mBufferOffset && offset < mBufferOffset + (mEnd - mBegin))
+    {
+        mPtr = mBegin + (offset - mBufferOffset);
+        return;
+    }
+
+    mBegin = mPtr = mEnd = mBuffer.data();
+    mBufferOffset = offset;
+}
+
+int QctReader::Cursor::refill()
+{
+    if(mReader.mMappedData != NULL)
+        return -1;
+
+    if(mBuffer.empty())
+        mBuffer.resize(mBufferSize);
+
+    uint64_t offset = tell();
+    size_t n = mReader.readAt(offset,mBuffer.data(),mBuffer.size());
+
+    mBegin = mPtr = mBuffer.data();
+    mEnd = mBegin + n;
+    mBufferOffset = offset;
+
+    if(n == 0)
+        return -1;
+
+    return *mPtr++;
+}
+
+int QctReader::Cursor::readInt()
+{
+    int b0 = getByte();
+    int b1 = getByte();
+    int b2 = getByte();
+    int b3 = getByte();
+
+    if((b0 | b1 | b2 | b3) < 0)
+        return -1;
+
+    return b0 | (b1 << 8) | (b2 << 16) | (b3 << 24);
+}
+
+double QctReader::Cursor::readDouble()
+{
+    uint64_t vv = 0;
+
+    for(int i=0;i<8;++i)
+        vv |= uint64_t(getByte() & 0xff) << (8*i);
+
+    double dd;
+    memcpy(&dd,&vv,sizeof(double));
+    return dd;
+}
+
+char *QctReader::Cursor::readString()
+{
+    int ii = readInt();
+
+    if(ii == 0 || ii == -1)
+        return strdup("");
+
+    uint64_t current_offset = tell();
+    std::string s;
+
+    seek(uint32_t(ii));	// yes, offsets are limited to 32-bits :-(
+
+    while((ii = getByte()) > 0)
+        s.push_back(char(ii));
+
+    seek(current_offset);
+
+    return strdup(s.c_str());
+}
+
+/* -------------------------------------------------------------------------
+ * Tile decoding
+ */
+
+static int bits_per_pixel(int num_colours)
+{
+    return (int)(log2(num_colours)+0.999);
+}
+
+// Huffman tables are a flat array of entries: values below 128 are colours (tree leaves), other values are
+// branches. When the next bit is 0 the branch is not followed and decoding proceeds with the next entry. When it
+// is 1, decoding jumps forward by 257-v entries, or by the amount given in the two following bytes when v is 128.
+
+static inline const unsigned char *huffmanNext(const unsigned char *huff_ptr, int bit_value)
+{
+    if (bit_value == 0)
+        return huff_ptr + ((*huff_ptr == 128)? 3 : 1);		// Don't jump just proceed to next entry in Huffman table
+    else if (*huff_ptr > 128)
+        return huff_ptr + 257 - (*huff_ptr);				// Near jump
+    else
+        return huff_ptr + 65537 - (256 * huff_ptr[2] + huff_ptr[1]) + 2;	// Far jump needs two more bytes
+}
+
+// Reference decoder: reads tile data one bit at a time following branches in Huffman tree.
+
+static void decodeHuffmanBitwise(QctReader::Cursor& c, const unsigned char *huff, unsigned char *tile_data)
+{
+    const unsigned char *huff_ptr = huff;
+    int pixelnum = 0;
+    int bits_left = 8;
+    int ii = c.getByte();
+
+    while (pixelnum < QctReader::TILE_PIXELS)
+    {
+        // If entry is a colour then output it
+        if (*huff_ptr < 128)
+        {
+            tile_data[pixelnum++] = *huff_ptr;
+            // Go back to top of tree for next pixel
+            huff_ptr = huff;
+            continue;
+        }
+        // Follow the branch according to the next "bit"
+        huff_ptr = huffmanNext(huff_ptr, ii & 1);
+
+        // Prepare for the following one
+        ii >>= 1;
+        if (--bits_left == 0)
+        {
+            ii = c.getByte();
+            bits_left = 8;
+        }
+    }
+}
+
+// Table-driven decoder. The tree is compiled into a flat lookup table indexed by the next HUFFMAN_LUT_BITS bits
+// of the stream (first bit in the LSB). Each entry gives the number of bits to consume and either the decoded
+// colour, or for codes longer than the table, the position in the tree reached after consuming them, from where
+// decoding proceeds bit by bit.
+
+static const int      HUFFMAN_LUT_BITS = 10;
+static const uint32_t HUFFMAN_LUT_LEAF = 0x80000000;
+
+static int huffmanDepth(const unsigned char *huff_ptr, int depth)
+{
+    if (*huff_ptr < 128 || depth == HUFFMAN_LUT_BITS)
+        return depth;
+
+    return std::max(huffmanDepth(huffmanNext(huff_ptr,0), depth+1), huffmanDepth(huffmanNext(huff_ptr,1), depth+1));
+}
+
+static void fillHuffmanLUT(const unsigned char *huff, const unsigned char *huff_ptr, int depth, uint32_t code, int lut_bits, uint32_t *lut)
+{
+    if (*huff_ptr < 128)
+    {
+        // All entries which low bits match the code decode to this colour
+        uint32_t entry = HUFFMAN_LUT_LEAF | (depth << 24) | *huff_ptr;
+
+        for (uint32_t k=0; k < (1u << (lut_bits - depth)); ++k)
+            lut[code | (k << depth)] = entry;
+    }
+    else if (depth == lut_bits)
+        lut[code] = (depth << 24) | (huff_ptr - huff);
+    else
+    {
+        fillHuffmanLUT(huff, huffmanNext(huff_ptr,0), depth+1, code               , lut_bits, lut);
+        fillHuffmanLUT(huff, huffmanNext(huff_ptr,1), depth+1, code | (1u << depth), lut_bits, lut);
+    }
+}
+
+static void decodeHuffmanTable(QctReader::Cursor& c, const unsigned char *huff, unsigned char *tile_data)
+{
+    uint32_t lut[1 << HUFFMAN_LUT_BITS];
+
+    // Only use as many bits as the tree needs, so that small trees have small tables.
+
+    const int lut_bits = huffmanDepth(huff, 0);
+    const uint32_t lut_mask = (1u << lut_bits) - 1;
+
+    fillHuffmanLUT(huff, huff, 0, 0, lut_bits, lut);
+
+    uint64_t bit_buffer = 0;
+    int bits_in_buffer = 0;
+
+    for (int pixelnum = 0; pixelnum < QctReader::TILE_PIXELS; )
+    {
+        // Keep at least 56 bits in the buffer. Past the end of the file, the stream reads as ones (like EOF does).
+
+        while (bits_in_buffer <= 56)
+        {
+            bit_buffer |= uint64_t(c.getByte() & 0xff) << bits_in_buffer;
+            bits_in_buffer += 8;
+        }
+
+        uint32_t entry = lut[bit_buffer & lut_mask];
+        int len = (entry >> 24) & 0x7f;
+
+        bit_buffer >>= len;
+        bits_in_buffer -= len;
+
+        if (entry & HUFFMAN_LUT_LEAF)
+        {
+            tile_data[pixelnum++] = entry & 0xff;
+            continue;
+        }
+
+        // Long code. Finish it one bit at a time.
+
+        const unsigned char *huff_ptr = huff + (entry & 0xffffff);
+
+        while (*huff_ptr >= 128)
+        {
+            if (bits_in_buffer == 0)
+            {
+                bit_buffer = c.getByte() & 0xff;
+                bits_in_buffer = 8;
+            }
+            huff_ptr = huffmanNext(huff_ptr, bit_buffer & 1);
+            bit_buffer >>= 1;
+            --bits_in_buffer;
+        }
+        tile_data[pixelnum++] = *huff_ptr;
+    }
+}
+
+bool QctReader::decodeTile(Cursor& c,unsigned char *dst,int stride,HuffmanDecoder method)
+{
+    unsigned char tile_data[QctReader::TILE_PIXELS];
+    int pixelnum = 0;
+    int ii;
+
+    // Rows are interleaved in this order (reverse binary)
+    static const int row_seq[] =
+    {
+        0,  32, 16, 48,  8, 40, 24, 56,  4, 36, 20, 52, 12, 44, 28, 60, 2,
+        34, 18, 50, 10, 42, 26, 58,  6, 38, 22, 54, 14, 46, 30, 62, 1,
+        33, 17, 49,  9, 41, 25, 57,  5, 37, 21, 53, 13, 45, 29, 61, 3, 35,
+        19, 51, 11, 43, 27, 59,  7, 39, 23, 55, 15, 47, 31, 63
+    };
+
+    memset(tile_data, 0, TILE_PIXELS);
+
+    // Determine which method was used to pack this tile
+    int packing = c.getByte();
+    bool ok = true;
+
+    if (packing < 0)
+        ok = false;
+    else if (packing == 0 || packing == 255)
+    {
+        // Huffman
+        std::vector<unsigned char> huff;
+        int num_colours = 0;
+        int num_branches = 0;
+
+        huff.reserve(256);
+
+        while (num_colours <= num_branches && !c.eof())
+        {
+            int v = c.getByte();
+            huff.push_back(v);
+
+            // Relative jump further than 128 needs two more bytes
+            if (v == 128)
+            {
+                huff.push_back(c.getByte());
+                huff.push_back(c.getByte());
+                num_branches++;
+            }
+            // Relative jump nearer is encoded directly
+            else if (v > 128)
+                num_branches++;	// Count number of branches so we know when tree is built
+            else
+                num_colours++;	// Otherwise it's a colour index into the palette
+        }
+        int huff_idx = huff.size();
+
+        if (num_colours <= num_branches)
+            ok = false;		// truncated file
+        // If only 1 colour then tile is solid colour so no data follows
+        else if (num_colours == 1)
+            memset(tile_data, huff[0], TILE_PIXELS);
+        else
+        {
+            // Validate Huffman table by ensuring all branches are within table
+            // (if not just return so tile will be not be unpacked, ie. blank)
+            int delta;
+            for (ii=0; ok && ii<huff_idx; ii++)
+            {
+                if (huff[ii] < 128)
+                    continue;
+                else if (huff[ii] == 128)
+                {
+                    if (ii+2 >= huff_idx)
+                        ok = false;
+                    else
+                    {
+                        delta = 65537 - (256 * huff[ii+2] + huff[ii+1]) + 2;
+                        if (ii+delta >= huff_idx)
+                            ok = false;
+                        ii += 2;
+                    }
+                }
+                else
+                {
+                    delta = 257 - huff[ii];
+                    if (ii+delta >= huff_idx)
+                        ok = false;
+                }
+            }
+
+            if (ok && method == HUFFMAN_BITWISE)
+                decodeHuffmanBitwise(c, huff.data(), tile_data);
+            else if (ok)
+                decodeHuffmanTable(c, huff.data(), tile_data);
+        }
+    }
+    else if (packing > 127)
+    {
+        // Pixel packing
+        int num_sub_colours = 256 - packing;
+        int shift = bits_per_pixel(num_sub_colours);
+        int mask = (1 << shift) - 1;
+        int num_pixels_per_word = 32 / shift;
+        int palette_index[256];
+
+        // Read the sub-palette
+        for (ii=0; ii<num_sub_colours; ii++)
+            palette_index[ii] = c.getByte();
+
+        // Read the pixels in 4-byte words and unpack the bits from each
+        while (pixelnum < TILE_PIXELS && !c.eof())
+        {
+            int runs;
+            ii = c.readInt();
+
+            for (runs = 0; runs < num_pixels_per_word && pixelnum < TILE_PIXELS; runs++)
+            {
+                tile_data[pixelnum++] = palette_index[ii & mask];
+                ii = ii >> shift;
+            }
+        }
+    }
+    else
+    {
+        // Run-length Encoding
+        int num_sub_colours = packing;
+        int num_low_bits = bits_per_pixel(num_sub_colours);
+        int pal_mask = (1 << num_low_bits)-1;
+        int palette_index[256];
+
+        for (ii=0; ii<num_sub_colours; ii++)
+            palette_index[ii] = c.getByte();
+
+        while (pixelnum < TILE_PIXELS && !c.eof())
+        {
+            int colour, runs;
+            ii = c.getByte();
+            colour = palette_index[ii & pal_mask];
+            runs = ii >> num_low_bits;
+
+            if (runs > TILE_PIXELS - pixelnum)
+                runs = TILE_PIXELS - pixelnum;
+
+            memset(tile_data + pixelnum, colour, runs);
+            pixelnum += runs;
+        }
+    }
+
+    if(!ok)
+        memset(tile_data, 0, TILE_PIXELS);
+
+    // Decommutate the interleaved rows and copy into the image
+    for (int yy=0; yy<TILE_SIZE; yy++)
+        memcpy(dst + row_seq[yy] * stride, tile_data+yy*TILE_SIZE, TILE_SIZE);
+
+    return ok;
+}
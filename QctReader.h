@@ -0,0 +1,115 @@
+#pragma once
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+// Low level access to the content of a QCT file.
+//
+// The file is memory-mapped when possible, so that headers, tile index and tile data are decoded straight
+// from memory. When mapping is not available (or not wanted) the same bytes are read through a buffered
+// pread() into a per-cursor buffer. In both cases the data is accessed through Cursor objects, which are cheap
+// to create, so that each decoding thread can own its own view on the file.
+//
+// QCT file format as documented in The_Quick_Chart_File_Format_Specification_1.01.pdf
+// All words are little-endian
+// Header: 24 words
+// Georef: 40 doubles
+// Palette: 256 words of RGB where blue is LSByte
+// Interp: 128x128 bytes
+// Index: w*h words
+// Data... tiles are 64x64 pixels
+
+class QctReader
+{
+public:
+    static const int      TILE_SIZE      = 64;
+    static const int      TILE_PIXELS    = TILE_SIZE*TILE_SIZE;
+    static const uint32_t MAGIC          = 0x1423D5FF;
+    static const uint32_t GEOREF_OFFSET  = 24*4;
+    static const uint32_t PALETTE_OFFSET = GEOREF_OFFSET + 40*8;
+    static const uint32_t INTERP_OFFSET  = PALETTE_OFFSET + 256*4;
+    static const uint32_t INDEX_OFFSET   = INTERP_OFFSET + 128*128;
+
+    enum AccessMode
+    {
+        ACCESS_MMAP  = 0x00,	// map the whole file in memory. Falls back to ACCESS_PREAD if mapping fails.
+        ACCESS_PREAD = 0x01		// read the file in chunks of BUFFER_SIZE bytes
+    };
+
+    enum HuffmanDecoder
+    {
+        HUFFMAN_TABLE   = 0x00,	// table-driven, resolves up to 10 bits per lookup
+        HUFFMAN_BITWISE = 0x01	// walks the tree one bit at a time. Slow, kept as a reference.
+    };
+
+    class Cursor
+    {
+    public:
+        // buffer_size is the size of the reads when the file is not mapped. Smaller buffers suit short reads of a
+        // known size, such as single tiles.
+        Cursor(const QctReader& reader, uint64_t offset, size_t buffer_size = BUFFER_SIZE);
+
+        // All read methods behave like their stdio counterparts: bytes read after the end of the file are -1 (EOF).
+
+        int getByte()  { return (mPtr < mEnd)? *mPtr++ : refill(); }
+        int peekByte() { int c = getByte(); if(c >= 0) --mPtr; return c; }
+
+        int    readInt();
+        double readDouble();
+
+        // Returns a string (nul-terminated) allocated from malloc obtained by reading an index pointer then
+        // following it. The cursor is left after the index pointer, not after the string. If the index pointer
+        // is nul then an empty string is returned (rather than a null pointer).
+        char *readString();
+
+        uint64_t tell() const { return mBufferOffset + (mPtr - mBegin) ; }
+        void seek(uint64_t offset);
+        bool eof() const { return mPtr >= mEnd && tell() >= mReader.size(); }
+
+    private:
+        int refill();
+
+        const QctReader& mReader;
+        const unsigned char *mBegin ;	// begining of the current window on the file
+        const unsigned char *mPtr ;		// current read position
+        const unsigned char *mEnd ;		// end of the current window
+        uint64_t mBufferOffset ;		// file offset of mBegin
+        size_t mBufferSize;
+        std::vector<unsigned char> mBuffer;	// only used when the file is not mapped
+    };
+
+    QctReader();
+    ~QctReader();
+
+    bool open(const std::string& filename, AccessMode mode = ACCESS_MMAP);
+    void close();
+
+    bool isOpen()      const { return mFd >= 0 ; }
+    AccessMode mode()  const { return mMode ; }
+    uint64_t size()    const { return mSize ; }
+
+    Cursor cursor(uint64_t offset, size_t buffer_size = BUFFER_SIZE) const { return Cursor(*this,offset,buffer_size); }
+
+    // Decodes the tile which data starts at the current cursor position. Tile rows are de-interleaved and
+    // written into dst, with consecutive rows separated by stride bytes. Returns false if the tile data is
+    // inconsistent, in which case the tile is left blank.
+
+    static bool decodeTile(Cursor& c, unsigned char *dst, int stride, HuffmanDecoder method = HUFFMAN_TABLE);
+
+    static const char *modeName(AccessMode mode) ;
+    static bool parseMode(const char *name, AccessMode& mode) ;
+
+private:
+    static const int BUFFER_SIZE = 64*1024;
+
+    QctReader(const QctReader&) = delete;
+    QctReader& operator=(const QctReader&) = delete;
+
+    size_t readAt(uint64_t offset, unsigned char *buf, size_t len) const;
+
+    int mFd;
+    AccessMode mMode;
+    uint64_t mSize;
+    const unsigned char *mMappedData;
+};
@@ -0,0 +1,92 @@
+#include "QctTileCache.h"
+
+QctTileCache::QctTileCache(size_t max_bytes)
+    : mMaxBytes(max_bytes), mBytes(0), mHits(0), mMisses(0), mEvictions(0)
+{
+}
+
+bool QctTileCache::find(uint32_t key, QByteArray& data)
+{
+    std::lock_guard<std::mutex> lock(mMutex);
+
+    auto it = mIndex.find(key);
+
+    if(it == mIndex.end())
+    {
+        ++mMisses;
+        return false;
+    }
+
+    mEntries.splice(mEntries.begin(),mEntries,it->second);	// move to front. Iterators stay valid.
+    data = it->second->second;
+    ++mHits;
+
+    return true;
+}
+
+void QctTileCache::insert(uint32_t key, const QByteArray& data)
+{
+    std::lock_guard<std::mutex> lock(mMutex);
+
+    auto it = mIndex.find(key);
+
+    if(it != mIndex.end())	// another thread decoded the same tile in the meantime
+    {
+        mBytes -= it->second->second.size();
+        mEntries.erase(it->second);
+        mIndex.erase(it);
+    }
+
+    mEntries.push_front(std::make_pair(key,data));
+    mIndex[key] = mEntries.begin();
+    mBytes += data.size();
+
+    evict();
+}
+
+void QctTileCache::evict()
+{
+    // Always keep the most recent entry, even if it alone exceeds the budget.
+
+    while(mBytes > mMaxBytes && mEntries.size() > 1)
+    {
+        const auto& e(mEntries.back());
+
+        mBytes -= e.second.size();
+        mIndex.erase(e.first);
+        mEntries.pop_back();
+        ++mEvictions;
+    }
+}
+
+void QctTileCache::setMaxBytes(size_t max_bytes)
+{
+    std::lock_guard<std::mutex> lock(mMutex);
+
+    mMaxBytes = max_bytes;
+    evict();
+}
+
+void QctTileCache::clear()
+{
+    std::lock_guard<std::mutex> lock(mMutex);
+
+    mEntries.clear();
+    mIndex.clear();
+    mBytes = 0;
+}
+
+QctTileCache::Statistics QctTileCache::statistics() const
+{
+    std::lock_guard<std::mutex> lock(mMutex);
+
+    Statistics s;
+    s.hits      = mHits;
+    s.misses    = mMisses;
+    s.evictions = mEvictions;
+    s.entries   = mEntries.size();
+    s.bytes     = mBytes;
+    s.max_bytes = mMaxBytes;
+
+    return s;
+}
@@ -0,0 +1,58 @@
+#pragma once
+
+#include <stdint.h>
+#include <list>
+#include <mutex>
+#include <unordered_map>
+#include <QByteArray>
+
+// LRU cache of decoded QCT tiles, bounded by the total size of the cached data.
+//
+// Tiles are stored as 8-bit palette indices, one byte per pixel. Cached data is handed out as implicitly shared
+// QByteArray, so that an entry can be evicted while a caller still uses it. All methods are thread-safe.
+
+class QctTileCache
+{
+public:
+    static const size_t DEFAULT_MAX_BYTES = 64*1024*1024;
+
+    struct Statistics
+    {
+        uint64_t hits;
+        uint64_t misses;
+        uint64_t evictions;
+        size_t   entries;
+        size_t   bytes;		// size of the cached tile data
+        size_t   max_bytes;
+    };
+
+    explicit QctTileCache(size_t max_bytes = DEFAULT_MAX_BYTES);
+
+    // Looks up tile "key". On success the tile becomes the most recently used one.
+    bool find(uint32_t key, QByteArray& data);
+
+    // Adds (or replaces) a tile, then evicts the least recently used tiles until the cache fits in its budget.
+    void insert(uint32_t key, const QByteArray& data);
+
+    void setMaxBytes(size_t max_bytes);
+    void clear();
+
+    Statistics statistics() const;
+
+private:
+    typedef std::list<std::pair<uint32_t,QByteArray> > EntryList;	// most recently used first
+
+    void evict();	// expects mMutex to be locked
+
+    mutable std::mutex mMutex;
+
+    EntryList mEntries;
+    std::unordered_map<uint32_t,EntryList::iterator> mIndex;
+
+    size_t mMaxBytes;
+    size_t mBytes;
+
+    uint64_t mHits;
+    uint64_t mMisses;
+    uint64_t mEvictions;
+};
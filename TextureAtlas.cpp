@@ -0,0 +1,284 @@
+#include <iostream>
+#include <algorithm>
+
+#include "TextureAtlas.h"
+
+TextureAtlas::TextureAtlas()
+    : mPageSize(0), mMaxBytes(size_t(MAX_PAGES) * 4 * PAGE_SIZE * PAGE_SIZE), mFrame(0), mEvictions(0)
+{
+    for(int c=0;c<NB_SIZES;++c)
+        mSizeClasses[c].open_page = -1;
+}
+
+int TextureAtlas::sizeClass(int W,int H)
+{
+    int c = 0;
+
+    while(c+1 < NB_SIZES && std::max(W,H) <= (MAX_SLOT_SIZE >> (c+1)))
+        ++c;
+
+    return c;
+}
+
+bool TextureAtlas::addPage(int size_class)
+{
+    if(mPageSize == 0)
+    {
+        GLint max_size = 0;
+        glGetIntegerv(GL_MAX_TEXTURE_SIZE,&max_size);
+
+        mPageSize = std::min(int(PAGE_SIZE),int(max_size));
+    }
+
+    if(mPageSize < MAX_SLOT_SIZE || int(mPages.size()) >= MAX_PAGES || (mPages.size()+1) * pageBytes() > mMaxBytes)
+        return false;
+
+    Page page;
+    page.size_class = size_class;
+    page.last_frame = 0;
+
+    glGenTextures(1,&page.texture);
+
+    glBindTexture(GL_TEXTURE_2D,page.texture);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S    , GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T    , GL_CLAMP_TO_EDGE);
+    glTexImage2D(GL_TEXTURE_2D,0,GL_RGBA8,mPageSize,mPageSize,0,GL_RGBA,GL_UNSIGNED_BYTE,NULL);
+
+    mSizeClasses[size_class].open_page = mPages.size();
+    mPages.push_back(page);
+
+#ifdef DEBUG
+    std::cerr << "Created texture atlas page " << mPages.size()-1 << " (" << mPageSize << "x" << mPageSize << ", slots of "
+              << slotSize(size_class) << "x" << slotSize(size_class) << ")" << std::endl;
+#endif
+
+    return true;
+}
+
+// Gives the least recently used page of another size, if not used in the current frame, to size_class. The textures
+// in that page are dropped.
+
+bool TextureAtlas::reclaimPage(int size_class)
+{
+    int p = -1;
+
+    for(uint32_t i=0;i<mPages.size();++i)
+        if(mPages[i].size_class != size_class && mPages[i].last_frame < mFrame && (p < 0 || mPages[i].last_frame < mPages[p].last_frame))
+            p = i;
+
+    if(p < 0)
+        return false;
+
+    Page& page(mPages[p]);
+    SizeClass& old_sc(mSizeClasses[page.size_class]);
+
+    for(uint32_t i=0;i<page.slots.size();++i)
+        if(page.slots[i].used)
+        {
+            old_sc.lru.erase(page.slots[i].lru_it);
+            mSlotOfKey.erase(page.slots[i].key);
+            ++mEvictions;
+        }
+
+    old_sc.free_slots.erase(std::remove_if(old_sc.free_slots.begin(),old_sc.free_slots.end(),[p](int s) { return s / MAX_SLOTS_PER_PAGE == p; }),
+                            old_sc.free_slots.end());
+
+    if(old_sc.open_page == p)
+        old_sc.open_page = -1;
+
+    page.slots.clear();
+    page.size_class = size_class;
+    mSizeClasses[size_class].open_page = p;
+
+#ifdef DEBUG
+    std::cerr << "Texture atlas page " << p << " now holds slots of " << slotSize(size_class) << "x" << slotSize(size_class) << std::endl;
+#endif
+
+    return true;
+}
+
+// Free slots come first, then never used slots of the open page, then a new page. Otherwise the least recently used
+// slot of the same size is taken from its current owner, or a page of another size is reclaimed.
+
+int TextureAtlas::allocateSlot(int size_class)
+{
+    SizeClass& sc(mSizeClasses[size_class]);
+    int s;
+
+    if(!sc.free_slots.empty())
+    {
+        s = sc.free_slots.back();
+        sc.free_slots.pop_back();
+    }
+    else if(sc.open_page >= 0 || addPage(size_class)
+            || ((sc.lru.empty() || slot(sc.lru.back()).last_frame == mFrame) && reclaimPage(size_class)))
+    {
+        Page& page(mPages[sc.open_page]);
+
+        int slot_size = slotSize(size_class);
+        int slots_per_row = mPageSize / slot_size;
+        int n = page.slots.size();
+
+        Slot new_slot;
+        new_slot.x = (n % slots_per_row) * slot_size;
+        new_slot.y = (n / slots_per_row) * slot_size;
+        new_slot.used = false;
+
+        page.slots.push_back(new_slot);
+
+        if(int(page.slots.size()) == slots_per_row*slots_per_row)
+            sc.open_page = -1;
+
+        s = (&page - &mPages[0]) * MAX_SLOTS_PER_PAGE + n;
+    }
+    else
+    {
+        if(sc.lru.empty() || slot(sc.lru.back()).last_frame == mFrame)
+            return -1;
+
+        s = sc.lru.back();
+        sc.lru.pop_back();
+
+        mSlotOfKey.erase(slot(s).key);
+        ++mEvictions;
+    }
+
+    Slot& new_slot(slot(s));
+
+    sc.lru.push_front(s);
+    new_slot.lru_it = sc.lru.begin();
+    new_slot.used = true;
+
+    return s;
+}
+
+void TextureAtlas::touch(int s)
+{
+    Slot& used_slot(slot(s));
+    std::list<int>& lru(mSizeClasses[pageSizeClass(s)].lru);
+
+    used_slot.last_frame = mFrame;
+    mPages[s / MAX_SLOTS_PER_PAGE].last_frame = mFrame;
+
+    lru.splice(lru.begin(),lru,used_slot.lru_it);
+}
+
+// Texture coordinates stop half a texel inside the image, so that linear filtering never reads the neighbouring slots.
+
+TextureAtlas::Location TextureAtlas::location(int s) const
+{
+    const Page& page(mPages[s / MAX_SLOTS_PER_PAGE]);
+    const Slot& slot(page.slots[s % MAX_SLOTS_PER_PAGE]);
+
+    Location loc;
+
+    loc.texture = page.texture;
+    loc.u0 = (slot.x + 0.5f) / mPageSize;
+    loc.v0 = (slot.y + 0.5f) / mPageSize;
+    loc.u1 = (slot.x + slot.W - 0.5f) / mPageSize;
+    loc.v1 = (slot.y + slot.H - 0.5f) / mPageSize;
+
+    return loc;
+}
+
+bool TextureAtlas::find(Key key,Location& loc,int& W,int& H)
+{
+    auto it = mSlotOfKey.find(key);
+
+    if(it == mSlotOfKey.end())
+        return false;
+
+    touch(it->second);
+
+    loc = location(it->second);
+    W = slot(it->second).W;
+    H = slot(it->second).H;
+
+    return true;
+}
+
+bool TextureAtlas::upload(Key key,const unsigned char *rgba_data,int W,int H,Location& loc)
+{
+    if(!fits(W,H))
+        return false;
+
+    int size_class = sizeClass(W,H);
+    auto it = mSlotOfKey.find(key);
+
+    if(it != mSlotOfKey.end() && pageSizeClass(it->second) != size_class)
+    {
+        release(key);
+        it = mSlotOfKey.end();
+    }
+
+    int s;
+
+    if(it != mSlotOfKey.end())
+        s = it->second;
+    else
+    {
+        if((s = allocateSlot(size_class)) < 0)
+            return false;
+
+        mSlotOfKey[key] = s;
+        slot(s).key = key;
+    }
+
+    Slot& used_slot(slot(s));
+
+    used_slot.W = W;
+    used_slot.H = H;
+    touch(s);
+
+    glBindTexture(GL_TEXTURE_2D,mPages[s / MAX_SLOTS_PER_PAGE].texture);
+    glPixelStorei(GL_UNPACK_ALIGNMENT,4);
+    glTexSubImage2D(GL_TEXTURE_2D,0,used_slot.x,used_slot.y,W,H,GL_RGBA,GL_UNSIGNED_BYTE,rgba_data);
+
+    loc = location(s);
+
+    return true;
+}
+
+void TextureAtlas::release(Key key)
+{
+    auto it = mSlotOfKey.find(key);
+
+    if(it == mSlotOfKey.end())
+        return;
+
+    int s = it->second;
+    SizeClass& sc(mSizeClasses[pageSizeClass(s)]);
+
+    sc.lru.erase(slot(s).lru_it);
+    slot(s).used = false;
+    sc.free_slots.push_back(s);
+    mSlotOfKey.erase(it);
+}
+
+void TextureAtlas::setMaxBytes(size_t max_bytes)
+{
+    mMaxBytes = max_bytes;
+
+    if(bytes() > mMaxBytes)
+        clear();
+}
+
+void TextureAtlas::clear(bool delete_textures)
+{
+    if(delete_textures)
+        for(uint32_t i=0;i<mPages.size();++i)
+            glDeleteTextures(1,&mPages[i].texture);
+
+    mPages.clear();
+    mSlotOfKey.clear();
+    mPageSize = 0;		// the next context may have a different maximum texture size
+
+    for(int c=0;c<NB_SIZES;++c)
+    {
+        mSizeClasses[c].free_slots.clear();
+        mSizeClasses[c].lru.clear();
+        mSizeClasses[c].open_page = -1;
+    }
+}
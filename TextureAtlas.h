@@ -0,0 +1,119 @@
+#pragma once
+
+#include <stdint.h>
+#include <list>
+#include <vector>
+#include <unordered_map>
+#include <GL/gl.h>
+
+// Packs small RGBA textures (e.g. QCT tiles) into shared texture pages, so that many images can be drawn with a single
+// texture bind.
+//
+// Pages are split into a grid of square slots, each holding one texture. Since textures shrink with the zoom level,
+// slot sizes are powers of 2 from MAX_SLOT_SIZE down to MIN_SLOT_SIZE, and each page only holds slots of one size: a
+// texture goes in the smallest slots it fits in. Pages are created when needed, up to MAX_PAGES in total, and as long as
+// they fit in the memory given by setMaxBytes(). When a size
+// has no free slot left, its least recently used slot is reused, or else the least recently used page of another size
+// is emptied and given to this size. Slots (and pages) used in the current frame are never reused: their location may
+// already be in the geometry being drawn. Needs a current GL context. Not thread-safe.
+
+class TextureAtlas
+{
+public:
+    typedef uint32_t Key;
+
+    static const int MAX_SLOT_SIZE = 64;
+    static const int MIN_SLOT_SIZE = 8;
+    static const int PAGE_SIZE = 4096;	// reduced to GL_MAX_TEXTURE_SIZE when smaller
+    static const int MAX_PAGES = 4;
+
+    // Texture and texture coordinates to draw an image with: (u0,v0) is the first pixel of the image data.
+    struct Location
+    {
+        GLuint texture;
+        GLfloat u0,v0,u1,v1;
+    };
+
+    TextureAtlas();
+
+    static bool fits(int W, int H) { return W <= MAX_SLOT_SIZE && H <= MAX_SLOT_SIZE; }
+
+    // Starts a new frame. Slots found or uploaded from now on are not reused before the next frame.
+    void nextFrame() { ++mFrame; }
+
+    // Looks up the texture currently uploaded for key, and its size.
+    bool find(Key key, Location& loc, int& W, int& H);
+
+    // Uploads WxH RGBA pixels for key, in the slot of key if it is of the right size. Returns false when no slot of
+    // that size can be used in the current frame.
+    bool upload(Key key, const unsigned char *rgba_data, int W, int H, Location& loc);
+
+    // Frees the slot of key, if any.
+    void release(Key key);
+
+    // Limits the memory used by pages. When the current pages do not fit anymore, they are all dropped.
+    void setMaxBytes(size_t max_bytes);
+
+    // Drops all pages. When the GL context has been destroyed, the textures are gone with it: delete_textures must then
+    // be false.
+    void clear(bool delete_textures = true);
+
+    uint32_t numberOfPages() const { return mPages.size(); }
+    size_t numberOfTextures() const { return mSlotOfKey.size(); }
+    size_t bytes() const { return mPages.size() * pageBytes(); }
+    uint64_t evictions() const { return mEvictions; }
+
+private:
+    static const int NB_SIZES = 4;	// MAX_SLOT_SIZE >> c, for c in [0,NB_SIZES)
+    static const int MAX_SLOTS_PER_PAGE = (PAGE_SIZE/MIN_SLOT_SIZE)*(PAGE_SIZE/MIN_SLOT_SIZE);
+
+    // Slots are identified by page*MAX_SLOTS_PER_PAGE + index in the page.
+
+    struct Slot
+    {
+        int x,y;			// position in the page, in pixels
+        int W,H;			// size of the texture in the slot
+        Key key;
+        bool used;
+        uint64_t last_frame;
+        std::list<int>::iterator lru_it;	// only valid when used
+    };
+
+    struct Page
+    {
+        GLuint texture;
+        int size_class;
+        uint64_t last_frame;		// last frame any of the slots was used in
+        std::vector<Slot> slots;	// handed out in order, then reused through the free lists
+    };
+
+    struct SizeClass
+    {
+        std::vector<int> free_slots;
+        std::list<int> lru;			// used slots, most recently used first
+        int open_page;				// page with never used slots, or -1
+    };
+
+    static int sizeClass(int W, int H);
+    int slotSize(int size_class) const { return MAX_SLOT_SIZE >> size_class; }
+
+    Slot& slot(int s) { return mPages[s / MAX_SLOTS_PER_PAGE].slots[s % MAX_SLOTS_PER_PAGE]; }
+    int pageSizeClass(int s) const { return mPages[s / MAX_SLOTS_PER_PAGE].size_class; }
+
+    int allocateSlot(int size_class);	// returns -1 when no slot can be used in this frame
+    bool addPage(int size_class);
+    bool reclaimPage(int size_class);
+    void touch(int s);
+    Location location(int s) const;
+
+    size_t pageBytes() const { return 4 * size_t(mPageSize) * mPageSize; }
+
+    int mPageSize;
+    size_t mMaxBytes;
+    std::vector<Page> mPages;
+    SizeClass mSizeClasses[NB_SIZES];
+    std::unordered_map<Key,int> mSlotOfKey;
+
+    uint64_t mFrame;
+    uint64_t mEvictions;
+};
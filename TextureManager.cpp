@@ -0,0 +1,200 @@
+#include <iostream>
+
+#include "TextureManager.h"
+
+TextureManager::TextureManager(size_t max_bytes)
+    : mPlaceholder(0), mBytes(0), mMaxBytes(max_bytes), mFrame(0), mUploads(0), mEvictions(0)
+{
+    mAtlas.setMaxBytes(mMaxBytes / 2);
+}
+
+// Location covering a whole texture of its own.
+
+static TextureAtlas::Location fullTexture(GLuint tex_id)
+{
+    TextureAtlas::Location loc;
+
+    loc.texture = tex_id;
+    loc.u0 = loc.v0 = 0.0;
+    loc.u1 = loc.v1 = 1.0;
+
+    return loc;
+}
+
+void TextureManager::nextFrame()
+{
+    ++mFrame;
+    mAtlas.nextFrame();
+}
+
+bool TextureManager::find(Key key,TextureAtlas::Location& loc,int& W,int& H)
+{
+    if(mAtlas.find(key,loc,W,H))
+        return true;
+
+    auto it = mTextures.find(key);
+
+    if(it == mTextures.end())
+        return false;
+
+    Texture& t(it->second);
+
+    t.last_frame = mFrame;
+    mLRU.splice(mLRU.begin(),mLRU,t.lru_it);
+
+    W = t.W;
+    H = t.H;
+    loc = fullTexture(t.id);
+
+    return true;
+}
+
+TextureAtlas::Location TextureManager::placeholder()
+{
+    if(mPlaceholder == 0)
+    {
+        static const unsigned char grey[4] = { 64,64,64,255 };
+
+        glGenTextures(1,&mPlaceholder);
+        glBindTexture(GL_TEXTURE_2D,mPlaceholder);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+        glTexImage2D(GL_TEXTURE_2D,0,GL_RGBA8,1,1,0,GL_RGBA,GL_UNSIGNED_BYTE,grey);
+    }
+    return fullTexture(mPlaceholder);
+}
+
+// Images move between the atlas and textures of their own as their texture size follows the zoom level. When the
+// atlas is full of textures used in this frame, small textures get a texture of their own as well.
+
+TextureAtlas::Location TextureManager::upload(Key key,const unsigned char *rgba_data,int W,int H)
+{
+    TextureAtlas::Location loc;
+    ++mUploads;
+
+    if(TextureAtlas::fits(W,H) && mAtlas.upload(key,rgba_data,W,H,loc))
+    {
+        deleteTexture(key);
+        return loc;
+    }
+    mAtlas.release(key);
+
+    size_t bytes = 4*size_t(W)*H;
+    auto it = mTextures.find(key);
+
+    if(it == mTextures.end())
+    {
+        evict(bytes);
+
+        Texture t;
+        glGenTextures(1,&t.id);
+
+        mLRU.push_front(key);
+        t.lru_it = mLRU.begin();
+        t.bytes = 0;
+
+        it = mTextures.insert(std::make_pair(key,t)).first;
+    }
+    else
+    {
+        mBytes -= it->second.bytes;
+        it->second.bytes = 0;
+        it->second.last_frame = mFrame;		// not to be evicted below
+        mLRU.splice(mLRU.begin(),mLRU,it->second.lru_it);
+
+        evict(bytes);
+    }
+
+    Texture& t(it->second);
+
+    t.W = W;
+    t.H = H;
+    t.bytes = bytes;
+    t.last_frame = mFrame;
+    mBytes += bytes;
+
+    glBindTexture(GL_TEXTURE_2D,t.id);
+    glPixelStorei(GL_UNPACK_ALIGNMENT,4);
+    glPixelStorei(GL_PACK_ALIGNMENT ,4);
+
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S    , GL_CLAMP);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T    , GL_CLAMP);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_R    , GL_CLAMP);
+
+    glTexImage2D(GL_TEXTURE_2D,0,GL_RGBA8,W,H,0,GL_RGBA,GL_UNSIGNED_BYTE,rgba_data);
+
+#ifdef DEBUG
+    std::cerr << "Uploading texture ID " << t.id << " for texture " << key << " (" << W << "x" << H << ")" << std::endl;
+#endif
+
+    return fullTexture(t.id);
+}
+
+void TextureManager::deleteTexture(Key key)
+{
+    auto it = mTextures.find(key);
+
+    if(it == mTextures.end())
+        return;
+
+    glDeleteTextures(1,&it->second.id);
+
+    mBytes -= it->second.bytes;
+    mLRU.erase(it->second.lru_it);
+    mTextures.erase(it);
+}
+
+void TextureManager::evict(size_t extra_bytes)
+{
+    while(mBytes + mAtlas.bytes() + extra_bytes > mMaxBytes && !mLRU.empty())
+    {
+        auto it = mTextures.find(mLRU.back());
+
+        if(it->second.last_frame == mFrame)
+            break;
+
+        deleteTexture(it->first);
+        ++mEvictions;
+    }
+}
+
+void TextureManager::setMaxBytes(size_t max_bytes)
+{
+    mMaxBytes = max_bytes;
+    mAtlas.setMaxBytes(mMaxBytes / 2);
+    evict(0);
+}
+
+void TextureManager::clear(bool delete_textures)
+{
+    if(delete_textures)
+    {
+        for(auto it(mTextures.begin());it!=mTextures.end();++it)
+            glDeleteTextures(1,&it->second.id);
+
+        if(mPlaceholder != 0)
+            glDeleteTextures(1,&mPlaceholder);
+    }
+
+    mAtlas.clear(delete_textures);
+    mTextures.clear();
+    mLRU.clear();
+    mPlaceholder = 0;
+    mBytes = 0;
+}
+
+TextureManager::Statistics TextureManager::statistics() const
+{
+    Statistics s;
+    s.textures       = mTextures.size();
+    s.atlas_textures = mAtlas.numberOfTextures();
+    s.atlas_pages    = mAtlas.numberOfPages();
+    s.bytes          = mBytes + mAtlas.bytes();
+    s.max_bytes      = mMaxBytes;
+    s.uploads        = mUploads;
+    s.evictions      = mEvictions;
+
+    return s;
+}
@@ -0,0 +1,82 @@
+#pragma once
+
+#include <stdint.h>
+#include <list>
+#include <unordered_map>
+#include <GL/gl.h>
+
+#include "TextureAtlas.h"
+
+// GL textures of the displayed images, bounded by the amount of texture memory they use.
+//
+// Small textures are packed in a TextureAtlas, larger ones get a texture of their own. When an upload would exceed the
+// budget, the least recently used textures of their own are deleted first, except those used in the current frame,
+// which are always kept so that the frame can be drawn. Atlas pages count in the budget, but are never deleted: they are
+// limited to half of the budget, so that larger textures always have room.
+//
+// Textures belong to the GL context current when they were created: when that context is destroyed, clear(false)
+// must be called so that the (now invalid) texture names are forgotten. Needs a current GL context. Not thread-safe.
+
+class TextureManager
+{
+public:
+    typedef uint32_t Key;
+
+    static const size_t DEFAULT_MAX_BYTES = 512*1024*1024;
+
+    struct Statistics
+    {
+        size_t   textures;			// textures of their own
+        size_t   atlas_textures;
+        size_t   atlas_pages;
+        size_t   bytes;				// texture memory, atlas pages included
+        size_t   max_bytes;
+        uint64_t uploads;
+        uint64_t evictions;			// textures of their own deleted to fit in the budget
+    };
+
+    explicit TextureManager(size_t max_bytes = DEFAULT_MAX_BYTES);
+
+    // Starts a new frame. Textures found or uploaded from now on are not evicted before the next frame.
+    void nextFrame();
+
+    // Looks up the texture currently uploaded for key, whatever its size.
+    bool find(Key key, TextureAtlas::Location& loc, int& W, int& H);
+
+    // Uploads WxH RGBA pixels for key, replacing its previous texture.
+    TextureAtlas::Location upload(Key key, const unsigned char *rgba_data, int W, int H);
+
+    // Uniform grey texture, for images which texture is not ready yet.
+    TextureAtlas::Location placeholder();
+
+    void setMaxBytes(size_t max_bytes);
+
+    // Drops all textures. delete_textures must be false when the GL context they belong to has been destroyed.
+    void clear(bool delete_textures = true);
+
+    Statistics statistics() const;
+
+private:
+    struct Texture
+    {
+        GLuint id;
+        int W,H;
+        size_t bytes;
+        uint64_t last_frame;
+        std::list<Key>::iterator lru_it;
+    };
+
+    void deleteTexture(Key key);
+    void evict(size_t extra_bytes);		// makes room for extra_bytes, if possible
+
+    TextureAtlas mAtlas;
+    std::unordered_map<Key,Texture> mTextures;
+    std::list<Key> mLRU;				// textures of their own, most recently used first
+    GLuint mPlaceholder;
+
+    size_t mBytes;						// textures of their own
+    size_t mMaxBytes;
+    uint64_t mFrame;
+    uint64_t mUploads;
+    uint64_t mEvictions;
+};
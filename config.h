@@ -1,4 +1,6 @@
 #define MAP_ROOT_DIRECTORY        "maps"
 #define MAP_DEFINITION_FILE_NAME  "file_map.xml"
+#define PIXEL_CACHE_DIRECTORY_NAME ".pixel_cache"	// decoded textures, in MAP_ROOT_DIRECTORY
+#define FEATURE_CACHE_DIRECTORY_NAME ".features"	// registration keypoints and descriptors, next to the images
 
 #define NOT_IMPLEMENTED() { std::cerr << __PRETTY_FUNCTION__ << ": not yet implemented." << std::endl; }
@@ -1,8 +1,12 @@
 TEMPLATE = app
 CONFIG = debug
 
-SOURCES = qct2png.cpp
+SOURCES = qct2png.cpp QctReader.cpp
+HEADERS = QctReader.h
 
 DEFINES *= USE_PNG
 
+QMAKE_CXXFLAGS *= -fopenmp
+LIBS *= -lgomp
+
 LIBS *= -lpng
@@ -1,4 +1,4 @@
-// COMPILE_LINE: g++ -g -o qct2png qct2png.cpp -D_FILE_OFFSET_BITS=64 -lstdc++
+// COMPILE_LINE: g++ -g -fopenmp -o qct2png qct2png.cpp QctReader.cpp -DUSE_PNG -D_FILE_OFFSET_BITS=64 -lstdc++ -lpng
 //
 /* > qct.cpp
  */
@@ -7,6 +7,7 @@
 #include <vector>
 #include <assert.h>
 #include <fstream>
+#include <algorithm>
 
 static const char SCCSid[] = "@(#)qct.c         1.02 (C) 2010 arb Convert QCT map to PNG";
 
@@ -31,31 +32,6 @@ static const char SCCSid[] = "@(#)qct.c         1.02 (C) 2010 arb Convert QCT ma
 #endif
 
 
-/*
- * 64-bit file I/O
- * Not specifically needed for the QCT decoder since it uses 32-bit
- * file offsets inside the file so can't be more than 2GB anyway.
- */
-#ifdef unix
-#define HAS_FOPEN64
-#endif
-
-#ifdef HAS_FOPEN64
-# ifndef _LARGEFILE64_SOURCE
-#  define _LARGEFILE64_SOURCE // see lf64 manual
-# endif
-# define FOPEN  fopen64
-# define FSEEKO fseeko64
-# define FTELLO ftello64
-# define OFF_T  off64_t
-#else
-# define FOPEN  fopen
-# define FSEEKO fseeko
-# define FTELLO ftello
-# define OFF_T  off_t
-#endif
-
-
 /*
  * Get command-line options
  */
@@ -79,6 +55,7 @@ static const char SCCSid[] = "@(#)qct.c         1.02 (C) 2010 arb Convert QCT ma
 #include <time.h>    // for ctime
 #include <math.h>    // for log2
 #include <errno.h>   // for errno
+#include <sys/time.h> // for gettimeofday
 
 #ifdef USE_GIFLIB
 #include "gif/gif.h"
@@ -88,9 +65,15 @@ static const char SCCSid[] = "@(#)qct.c         1.02 (C) 2010 arb Convert QCT ma
 #include <png.h>
 #endif
 
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
 #ifdef USE_TIFF
 #endif
 
+#include "QctReader.h"
+
 
 // QCT file format
 // as documented in:
@@ -112,23 +95,17 @@ static const char SCCSid[] = "@(#)qct.c         1.02 (C) 2010 arb Convert QCT ma
 #define PAL_BLUE(c)  ((c)&255)
 
 
-/* -------------------------------------------------------------------------
- * Generic little-endian file-reading
- */
-int
-readInt(FILE *fp)
+// Image rows provider for streamed PNG output
+typedef const unsigned char *(*PNGRowCallback)(int row, void *user);
+struct ImageRows
 {
-	int vv;
-	vv = fgetc(fp);
-	vv |= (fgetc(fp) << 8);
-	vv |= (fgetc(fp) << 16);
-	vv |= (fgetc(fp) << 24);
-	if (feof(fp)) return(-1);
-	return(vv);
-}
+	const unsigned char *data;
+	int W;
+};
 
-static bool writePNGFile(FILE *, const unsigned char *data, const int *palette, int W, int H);
+static bool writePNGFile(FILE *, const int *palette, int W, int H, PNGRowCallback get_row, void *user);
 static bool writePNGFilename(const char *filename, const unsigned char *data, const int *palette, int W, int H);
+static bool writePNGFilename(const char *filename, const int *palette, int W, int H, PNGRowCallback get_row, void *user);
 
 class KmzFile
 {
@@ -185,93 +162,16 @@ void KmzFile::writeToFile(const std::string& fname) const
     o.close();
 }
 
-double
-readDouble(FILE *fp)
-{
-	double dd;
-	unsigned char *pp = (unsigned char*)&dd;
-#ifdef _LITTLE_ENDIAN
-	pp[0] = fgetc(fp);
-	pp[1] = fgetc(fp);
-	pp[2] = fgetc(fp);
-	pp[3] = fgetc(fp);
-	pp[4] = fgetc(fp);
-	pp[5] = fgetc(fp);
-	pp[6] = fgetc(fp);
-	pp[7] = fgetc(fp);
-#else
-	pp[7] = fgetc(fp);
-	pp[6] = fgetc(fp);
-	pp[5] = fgetc(fp);
-	pp[4] = fgetc(fp);
-	pp[3] = fgetc(fp);
-	pp[2] = fgetc(fp);
-	pp[1] = fgetc(fp);
-	pp[0] = fgetc(fp);
-#endif
-	return(dd);
-}
-
-
 /* -------------------------------------------------------------------------
- * Returns a string (nul-terminated) allocated from malloc
- * obtained by reading an index pointer then following it
- * by seeking into the file.  NB. file pointer upon return
- * will be after the index pointer not after the string.
- * If index pointer is nul then an empty string is returned
- * (rather than a null pointer).
+ * Wall clock time in seconds, for timing reports.
  */
-char *
-readString(FILE *fp)
+static double current_time()
 {
-	OFF_T current_offset, string_offset;
-	int ii;
-	char *string;
-	int string_length = 0, buf_length = 1024;
-
-	string = (char*)malloc(buf_length);
-	ii = readInt(fp);
-	if (ii == 0)
-		return(strdup(""));
-	current_offset = FTELLO(fp);
-	string_offset = ii; // yes, offsets are limited to 32-bits :-(
-	FSEEKO(fp, string_offset, SEEK_SET);
-	while (1)
-	{
-		ii = fgetc(fp);
-		string[string_length] = ii;
-		if (ii == 0)
-			break;
-		string_length++;
-		if (string_length > buf_length)
-		{
-			buf_length += 1024;
-			string = (char*)realloc(string, buf_length);
-		}
-	}
-	string = (char*)realloc(string, string_length+1);
-	FSEEKO(fp, current_offset, SEEK_SET);
-	return(string);
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec + tv.tv_usec * 1e-6;
 }
 
-
-/* -------------------------------------------------------------------------
- */
-int
-bits_per_pixel(int num_colours)
-{
-	return (int)(log2(num_colours)+0.999);
-	/* Alrernatively: */
-	if (num_colours <=   2) return 1;
-	if (num_colours <=   4) return 2;
-	if (num_colours <=   8) return 3;
-	if (num_colours <=  16) return 4;
-	if (num_colours <=  32) return 5;
-	if (num_colours <=  64) return 6;
-	if (num_colours <= 128) return 7;
-}
-
-
 /* -------------------------------------------------------------------------
  * Class to read a QCT map image.
  */
@@ -290,17 +190,24 @@ public:
                             double& lat_01, double& lon_01,
                             double& lat_11, double& lon_11 );
 
-	void debugmsg(const char *fmt, ...);
+	void debugmsg(const char *fmt, ...) const;
 protected:
 	void throwError(const char *fmt, ...);
-	void readTile(FILE *, int tile_x, int tile_y,unsigned char *data);
+	void readTile(QctReader::Cursor&, int tile_x, int tile_y,unsigned char *tile_ptr, int bytes_per_row) const;
+	bool readHeader();
 	int xy_to_latlon(int pixel_x, int pixel_y, double *lat, double *lon);
 public:
 	void setDebug(int d)     { debug = d; }
 	void setVerbose(int v)   { verbose = v; }
 	void setBounds(int _top_left_x,int _top_left_y,int _size_x,int _size_y)   { top_left_x=_top_left_x; top_left_y=_top_left_y;size_x=_size_x;size_y=_size_y; }
-	bool readFile(FILE *, int headeronly, unsigned char *data);
-	bool readFilename(const char *filename, int headeronly, unsigned char *image_data);
+	void getBounds(int& _top_left_x,int& _top_left_y,int& _size_x,int& _size_y) const { _top_left_x=top_left_x; _top_left_y=top_left_y; _size_x=size_x; _size_y=size_y; }
+	void setReaderMode(QctReader::AccessMode m) { reader_mode = m; }
+	void setThreads(int n)   { threads = n; }
+	int numThreads() const;
+	bool openFile(const char *filename);
+	void decodeTiles(int x0, int y0, int nx, int ny, unsigned char *data) const;
+	void decodeTiles(unsigned char *data) const { decodeTiles(top_left_x, top_left_y, size_x, size_y, data); }
+	bool benchmarkTiles(int repeat);
 	void printMetadata(FILE *fp);
 	//bool writePPMFile(FILE *);
 	//bool writePPMFilename(const char *filename);
@@ -309,7 +216,9 @@ public:
     const int *getPalette() const { return palette ; }
 
 private:
+	QctReader reader;          // kept open as long as the object lives
 	int width, height;         // size in tiles (of 64x64 each)
+	std::vector<uint32_t> tile_index; // file offset of each tile
 	int top_left_x,top_left_y,size_x,size_y;	// subparts of the tiles that will be output into an image
 	int palette[256];          // combined RGB in each int
 	unsigned char *image_data; // one pixel per byte
@@ -339,6 +248,8 @@ private:
 	double datum_shift_north, datum_shift_east;
 	// Program options
 	int verbose, debug, debug_kml_outline, debug_kml_boundary;
+	QctReader::AccessMode reader_mode;
+	int threads;               // number of decoding threads. 0 means OpenMP default.
 	FILE *dfp; // debug output goes here
 };
 
@@ -368,6 +279,8 @@ QCT::QCT()
 
 	// Program options
 	verbose = debug = debug_kml_outline = debug_kml_boundary = 0;
+	reader_mode = QctReader::ACCESS_MMAP;
+	threads = 0;
 	dfp = stdout;
 }
 
@@ -426,7 +339,7 @@ QCT::message(const char *fmt, ...)
 
 
 void
-QCT::debugmsg(const char *fmt, ...)
+QCT::debugmsg(const char *fmt, ...) const
 {
 	va_list ap;
 	va_start(ap, fmt);
@@ -442,427 +355,293 @@ QCT::debugmsg(const char *fmt, ...)
 /* -------------------------------------------------------------------------
  */
 void
-QCT::readTile(FILE *fp, int tile_xx, int tile_yy,unsigned char *data)
+QCT::readTile(QctReader::Cursor& c, int tile_xx, int tile_yy,unsigned char *tile_ptr, int bytes_per_row) const
 {
-	unsigned char tile_data[QCT_TILE_PIXELS];
-	unsigned char *row_ptr[QCT_TILE_SIZE];
 	int packing;
-	unsigned long row, bytes_per_row;
-	int pixelnum = 0;
-	int ii;
-	// Rows are interleaved in this order (reverse binary)
-	static int row_seq[] =
-	{
-		0,  32, 16, 48,  8, 40, 24, 56,  4, 36, 20, 52, 12, 44, 28, 60, 2,
-		34, 18, 50, 10, 42, 26, 58,  6, 38, 22, 54, 14, 46, 30, 62, 1,
-		33, 17, 49,  9, 41, 25, 57,  5, 37, 21, 53, 13, 45, 29, 61, 3, 35,
-		19, 51, 11, 43, 27, 59,  7, 39, 23, 55, 15, 47, 31, 63
-	};
-
 
-	debugmsg("Tile %d, %d starts at file offset 0x%x", tile_xx, tile_yy, FTELLO(fp));
+	debugmsg("Tile %d, %d starts at file offset 0x%llx", tile_xx, tile_yy, (unsigned long long)c.tell());
 
 	// Determine which method was used to pack this tile
-	packing = fgetc(fp);
+	packing = c.peekByte();
 
 	debugmsg("Reading tile %d, %d; packed using %s", tile_xx, tile_yy, ((packing==0||packing==255)?"huffman":(packing>127?"pixel":"RLE")));
 
-	memset(tile_data, 0, QCT_TILE_PIXELS);
-
-	// Size for one whole row in data
-	bytes_per_row = size_x * QCT_TILE_SIZE;
-
-	assert(tile_xx >= top_left_x) ;
-	assert(tile_yy >= top_left_y) ;
-
-	// Calculate pointer into data for each row in this tile
-	for (row=0; row<QCT_TILE_SIZE; row++)
-	{
-		// Top left corner of tile within image
-		row_ptr[row] = data + ( (tile_yy-top_left_y) * QCT_TILE_SIZE * bytes_per_row) + ((tile_xx-top_left_x) * QCT_TILE_SIZE);
-		// Interleaved rows in the above sequence
-		row_ptr[row] += row_seq[row] * bytes_per_row;
-	}
-
-	// Uncompress each row
-	if (packing == 0 || packing == 255)
-	{
-		// Huffman
-		//debugmsg("Huffman");
-		int huff_size = 256;
-		unsigned char *huff = (unsigned char *)malloc(huff_size);
-		unsigned char *huff_ptr = huff;
-		int huff_idx = 0;
-		int num_colours = 0;
-		int num_branches = 0;
-		while (num_colours <= num_branches)
-		{
-			huff[huff_idx] = getc(fp);
-			// Relative jump further than 128 needs two more bytes
-			if (huff[huff_idx] == 128)
-			{
-				huff[++huff_idx] = getc(fp);
-				huff[++huff_idx] = getc(fp);
-				num_branches++;
-			}
-			// Relative jump nearer is encoded directly
-			else if (huff[huff_idx] > 128)
-			{
-				// Count number of branches so we know when tree is built
-				num_branches++;
-			}
-			// Otherwise it's a colour index into the palette
-			else
-			{
-				// Count number of colours so we know when tree is built
-				num_colours++;
-			}
-			huff_idx++;
-			// Make space when Huffman table runs out of space
-			if (huff_idx > huff_size)
-			{
-				huff_size += 256;
-				huff = (unsigned char*)realloc(huff, huff_size);
-			}
-		}
-		// If only 1 colour then tile is solid colour so no data follows
-		if (num_colours == 1)
-		{
-			memset(tile_data, huff[0], QCT_TILE_PIXELS);
-		}
-		else
-		{
-			// Validate Huffman table by ensuring all branches are within table
-			// (if not just return so tile will be not be unpacked, ie. blank)
-			{
-				int ii, delta;
-				for (ii=0; ii<huff_idx; ii++)
-				{
-					if (huff[ii] < 128)
-						continue;
-					else if (huff[ii] == 128)
-					{
-						if (ii+2 >= huff_idx)
-							return;
-						delta = 65537 - (256 * huff[ii+2] + huff[ii+1]) + 2;
-						if (ii+delta >= huff_idx)
-							return;
-						ii += 2;
-					}
-					else
-					{
-						delta = 257 - huff[ii];
-						if (ii+delta >= huff_idx)
-							return;
-					}
-				}
-			}
-			// Read tile data one bit at a time following branches in Huffman tree
-			int bits_left = 8;
-			int bit_value;
-			ii = fgetc(fp);
-			while (pixelnum < QCT_TILE_PIXELS)
-			{
-				// If entry is a colour then output it
-				if (*huff_ptr < 128)
-				{
-					tile_data[pixelnum++] = *huff_ptr;
-					// Go back to top of tree for next pixel
-					huff_ptr = huff;
-					continue;
-				}
-				// Get the next "bit"
-				bit_value = (ii & 1);
-				// Prepare for the following one
-				ii >>= 1;
-				bits_left--;
-				if (bits_left == 0)
-				{
-					ii = fgetc(fp);
-					bits_left = 8;
-				}
-				// Now check value to see whether to follow branch or not
-				if (bit_value == 0)
-				{
-					// Don't jump just proceed to next entry in Huffman table
-					if (*huff_ptr == 128) huff_ptr+=2;
-					huff_ptr++;
-				}
-				else
-				{
-					// Follow branch to different part of Huffman table
-					if (*huff_ptr > 128)
-					{
-						// Near jump
-						huff_ptr += 257 - (*huff_ptr);
-					}
-					else if (*huff_ptr == 128)
-					{
-						// Far jump needs two more bytes
-						int delta = 65537 - (256 * huff_ptr[2] + huff_ptr[1]) + 2;
-						huff_ptr += delta;
-					}
-					// NB < 128 already handled above
-				}
-			}
-		}
-	}
-
-	else if (packing > 127)
-	{
-		// Pixel packing
-		int num_sub_colours = 256 - packing;
-		int shift = bits_per_pixel(num_sub_colours);
-		int mask = (1 << shift) - 1;
-		int num_pixels_per_word = 32 / shift;
-		int palette_index[256];
-		debugmsg("PACKED: sub-palette size is %d (%d bits)", num_sub_colours, shift);
-		// Read the sub-palette
-		for (ii=0; ii<num_sub_colours; ii++)
-		{
-			palette_index[ii] = fgetc(fp);
-			debugmsg("PACKED: palette %d = %d", ii, palette_index[ii]);
-		}
-		// Read the pixels in 4-byte words and unpack the bits from each
-		while (pixelnum < QCT_TILE_PIXELS)
-		{
-			int colour, runs;
-			ii = readInt(fp);
-			for (runs = 0; runs < num_pixels_per_word; runs++)
-		 	{
-				colour = ii & mask;
-				ii = ii >> shift;
-				tile_data[pixelnum++] = palette_index[colour];
-			}
-		}
-	}
-
-	else
-	{
-		// Run-length Encoding
-		int num_sub_colours = packing;
-		int num_low_bits = bits_per_pixel(num_sub_colours);
-		int pal_mask = (1 << num_low_bits)-1;
-		int palette_index[256];
-		//debugmsg("RLE: sub-palette size is %d (uses %d bits) mask 0x%x", num_sub_colours, num_low_bits, pal_mask);
-		for (ii=0; ii<num_sub_colours; ii++)
-		{
-			palette_index[ii] = fgetc(fp);
-			//debugmsg("RLE palette %d = %d", ii, palette_index[ii]);
-		}
-		while (pixelnum < QCT_TILE_PIXELS)
-		{
-			int colour, runs;
-			ii = fgetc(fp);
-			colour = ii & pal_mask;
-			runs = ii >> num_low_bits;
-			//debugmsg("RLE value 0x%x is colour %d for %d runs [%d..%d]", ii, colour, runs, pixelnum, pixelnum+runs);
-			while (runs-- > 0)
-			{
-				tile_data[pixelnum++] = palette_index[colour];
-			}
-		}
-	}
-
-	// Decommutate the interleaved rows and copy into the image
-	{
-		int yy;
-		for (yy=0; yy<QCT_TILE_SIZE; yy++)
-		{
-			memcpy(row_ptr[yy], tile_data+yy*QCT_TILE_SIZE, QCT_TILE_SIZE);
-		}
-	}
+	// Rows are de-interleaved by the decoder.
+	if (!QctReader::decodeTile(c, tile_ptr, bytes_per_row))
+		debugmsg("Tile %d, %d could not be decoded. Left blank.", tile_xx, tile_yy);
 }
 
 
 bool
-QCT::readFile(FILE *fp, int headeronly,unsigned char *data)
+QCT::readHeader()
 {
 	int ii;
+	QctReader::Cursor c = reader.cursor(0);
 
 	// Read Metadata
-	ii = readInt(fp);
+	ii = c.readInt();
 	if (ii != QCT_MAGIC)
 	{
 		throwError("Not a QCT file (%x != %x)\n",ii,QCT_MAGIC);
 		return false;
 	}
 
-	metadata.version = readInt(fp);
-	width  = readInt(fp);
-	height = readInt(fp);
-	metadata.title      = readString(fp);
-	metadata.name       = readString(fp);
-	metadata.ident      = readString(fp);
-	metadata.edition    = readString(fp);
-	metadata.revision   = readString(fp);
-	metadata.keywords   = readString(fp);
-	metadata.copyright  = readString(fp);
-	metadata.scale      = readString(fp);
-	metadata.datum      = readString(fp);
-	metadata.depths     = readString(fp);
-	metadata.heights    = readString(fp);
-	metadata.projection = readString(fp);
-	metadata.flags      = readInt(fp);
-	metadata.origfilename = readString(fp);
-	metadata.origfilesize = readInt(fp);
-	metadata.origfiletime = readInt(fp);
-	metadata.unknown1     = readInt(fp);
+	metadata.version = c.readInt();
+	width  = c.readInt();
+	height = c.readInt();
+
+	// The tile index alone takes 4 bytes per tile: larger sizes come from a corrupt or truncated file
+	if (width <= 0 || height <= 0 || uint64_t(width) * uint64_t(height) * 4 > reader.size())
+	{
+		throwError("Invalid map size (%d x %d tiles)", width, height);
+		return false;
+	}
+	metadata.title      = c.readString();
+	metadata.name       = c.readString();
+	metadata.ident      = c.readString();
+	metadata.edition    = c.readString();
+	metadata.revision   = c.readString();
+	metadata.keywords   = c.readString();
+	metadata.copyright  = c.readString();
+	metadata.scale      = c.readString();
+	metadata.datum      = c.readString();
+	metadata.depths     = c.readString();
+	metadata.heights    = c.readString();
+	metadata.projection = c.readString();
+	metadata.flags      = c.readInt();
+	metadata.origfilename = c.readString();
+	metadata.origfilesize = c.readInt();
+	metadata.origfiletime = c.readInt();
+	metadata.unknown1     = c.readInt();
 
 	// Pointer to extended metadata
 	{
-		OFF_T current_position, extended_position;
-		extended_position = readInt(fp);
-		current_position = FTELLO(fp);
-		FSEEKO(fp, extended_position, SEEK_SET);
-		metadata.maptype = readString(fp);
+		uint64_t current_position, extended_position;
+		extended_position = (uint32_t)c.readInt();
+		current_position = c.tell();
+		c.seek(extended_position);
+		metadata.maptype = c.readString();
 		// Pointer to datum shift
 		{
-			OFF_T current_position, datum_shift_position;
-			datum_shift_position = readInt(fp);
-			current_position = FTELLO(fp);
-			FSEEKO(fp, datum_shift_position, SEEK_SET);
-			datum_shift_north = readDouble(fp);
-			datum_shift_east  = readDouble(fp);
-			FSEEKO(fp, current_position, SEEK_SET);
+			uint64_t current_position, datum_shift_position;
+			datum_shift_position = (uint32_t)c.readInt();
+			current_position = c.tell();
+			c.seek(datum_shift_position);
+			datum_shift_north = c.readDouble();
+			datum_shift_east  = c.readDouble();
+			c.seek(current_position);
 		}
-		metadata.diskname = readString(fp);
-		metadata.unknown2 = readInt(fp);
-		metadata.unknown3 = readInt(fp);
-		metadata.unknown4 = readInt(fp);
-		metadata.unknown5 = readInt(fp);
-		metadata.unknown6 = readInt(fp);
-		FSEEKO(fp, current_position, SEEK_SET);
+		metadata.diskname = c.readString();
+		metadata.unknown2 = c.readInt();
+		metadata.unknown3 = c.readInt();
+		metadata.unknown4 = c.readInt();
+		metadata.unknown5 = c.readInt();
+		metadata.unknown6 = c.readInt();
+		c.seek(current_position);
 	}
 
 	// Map outline
-	num_outline = readInt(fp);  // number of map outline points
+	num_outline = c.readInt();  // number of map outline points
 	outline_lat = (double*)calloc(num_outline, sizeof(double));
 	outline_lon = (double*)calloc(num_outline, sizeof(double));
 	// Pointer to map outline
 	{
 		int outline;
-		OFF_T current_position, outline_position;
-		outline_position = readInt(fp);
-		current_position = FTELLO(fp);
-		FSEEKO(fp, outline_position, SEEK_SET);
+		uint64_t current_position, outline_position;
+		outline_position = (uint32_t)c.readInt();
+		current_position = c.tell();
+		c.seek(outline_position);
 		for (outline=0; outline<num_outline; outline++)
 		{
-			outline_lat[outline] = readDouble(fp);
-			outline_lon[outline] = readDouble(fp);
+			outline_lat[outline] = c.readDouble();
+			outline_lon[outline] = c.readDouble();
 		}
-		FSEEKO(fp, current_position, SEEK_SET);
+		c.seek(current_position);
 	}
 
 	// Georeferencing ceofficients
 
-	eas = readDouble(fp);
-	easY = readDouble(fp);
-	easX = readDouble(fp);
-	easYY = readDouble(fp);
-	easXY = readDouble(fp);
-	easXX = readDouble(fp);
-	easYYY = readDouble(fp);
-	easYYX = readDouble(fp);
-	easYXX = readDouble(fp);
-	easXXX = readDouble(fp);
-
-	nor = readDouble(fp);
-	norY = readDouble(fp);
-	norX = readDouble(fp);
-	norYY = readDouble(fp);
-	norXY = readDouble(fp);
-	norXX = readDouble(fp);
-	norYYY = readDouble(fp);
-	norYYX = readDouble(fp);
-	norYXX = readDouble(fp);
-	norXXX = readDouble(fp);
-
-	lat = readDouble(fp);
-	latX = readDouble(fp);
-	latY = readDouble(fp);
-	latXX = readDouble(fp);
-	latXY = readDouble(fp);
-	latYY = readDouble(fp);
-	latXXX = readDouble(fp);
-	latXXY = readDouble(fp);
-	latXYY = readDouble(fp);
-	latYYY = readDouble(fp);
-
-	lon = readDouble(fp);
-	lonX = readDouble(fp);
-	lonY = readDouble(fp);
-	lonXX = readDouble(fp);
-	lonXY = readDouble(fp);
-	lonYY = readDouble(fp);
-	lonXXX = readDouble(fp);
-	lonXXY = readDouble(fp);
-	lonXYY = readDouble(fp);
-	lonYYY = readDouble(fp);
+	eas = c.readDouble();
+	easY = c.readDouble();
+	easX = c.readDouble();
+	easYY = c.readDouble();
+	easXY = c.readDouble();
+	easXX = c.readDouble();
+	easYYY = c.readDouble();
+	easYYX = c.readDouble();
+	easYXX = c.readDouble();
+	easXXX = c.readDouble();
+
+	nor = c.readDouble();
+	norY = c.readDouble();
+	norX = c.readDouble();
+	norYY = c.readDouble();
+	norXY = c.readDouble();
+	norXX = c.readDouble();
+	norYYY = c.readDouble();
+	norYYX = c.readDouble();
+	norYXX = c.readDouble();
+	norXXX = c.readDouble();
+
+	lat = c.readDouble();
+	latX = c.readDouble();
+	latY = c.readDouble();
+	latXX = c.readDouble();
+	latXY = c.readDouble();
+	latYY = c.readDouble();
+	latXXX = c.readDouble();
+	latXXY = c.readDouble();
+	latXYY = c.readDouble();
+	latYYY = c.readDouble();
+
+	lon = c.readDouble();
+	lonX = c.readDouble();
+	lonY = c.readDouble();
+	lonXX = c.readDouble();
+	lonXY = c.readDouble();
+	lonYY = c.readDouble();
+	lonXXX = c.readDouble();
+	lonXXY = c.readDouble();
+	lonXYY = c.readDouble();
+	lonYYY = c.readDouble();
 
 	// Palette
 	for (ii=0; ii<256; ii++)
 	{
-		palette[ii] = readInt(fp);
+		palette[ii] = c.readInt();
 	}
 
 	// Interpolation matrix (128 x 128)
-	for (ii=0; ii<128*128; ii++)
-	{
-		fgetc(fp);
-	}
+	c.seek(c.tell() + 128*128);
 
-		if(size_x == 0) size_x = width ;
+	if(size_x == 0) size_x = width ;
 	if(size_y == 0) size_y = height ;
 
-// Don't read and unpack image data if not required
-	if (headeronly)
-		return true;
+	// Tile index (width * height pointers), read once for all
+	tile_index.resize(width * height);
 
+	for (ii=0; ii<width*height; ii++)
+		tile_index[ii] = c.readInt();
 
+	return(true);
+}
+
+
+/* -------------------------------------------------------------------------
+ * Decodes the nx*ny tiles starting at tile (x0,y0) into data, which is
+ * (nx*64) pixels wide. Tiles outside the map are
+ * left untouched. Only uses the tile index read by openFile(), so it can be
+ * called concurrently for different regions.
+ */
+void
+QCT::decodeTiles(int x0, int y0, int nx, int ny, unsigned char *data) const
+{
+	int n_x = std::max(0, std::min(x0 + nx, width ) - x0);
+	int n_y = std::max(0, std::min(y0 + ny, height) - y0);
+	int bytes_per_row = nx * QCT_TILE_SIZE;
+
+	// Tiles are independent and write disjoint parts of the image, so they are decoded in parallel,
+	// each thread reading the file through its own cursor.
+
+#pragma omp parallel num_threads(numThreads()) if(threads != 1)
 	{
-		int xx, yy;
-		for (yy=0; yy<height; yy++)
-		{
-			debugmsg("  handling tiles (*,%d/%d)",yy,height) ;
+		QctReader::Cursor tile_cursor = reader.cursor(0);
 
-			for (xx=0; xx<width; xx++)
-			{
-				OFF_T current_offset, tile_offset;
-				tile_offset = readInt(fp);
-				current_offset = FTELLO(fp);
-					
-				if(xx >= top_left_x && xx < top_left_x + size_x && yy >= top_left_y && yy < top_left_y + size_y)
-				{
-					FSEEKO(fp, tile_offset, SEEK_SET);
-					//debugmsg("Would read tile %d, %d packing %d at offset %x", xx, yy, fgetc(fp), tile_offset);
-					readTile(fp, xx, yy,data);
+#pragma omp for schedule(dynamic,8)
+		for (int ii=0; ii<n_x*n_y; ii++)
+		{
+			int xx = ii % n_x;
+			int yy = ii / n_x;
 
-					FSEEKO(fp, current_offset, SEEK_SET);
-				}
-			}
+			tile_cursor.seek(tile_index[(y0+yy)*width + x0+xx]);
+			readTile(tile_cursor, x0+xx, y0+yy, data + yy * QCT_TILE_SIZE * bytes_per_row + xx * QCT_TILE_SIZE, bytes_per_row);
 		}
 	}
+}
 
-	return(true);
+
+int
+QCT::numThreads() const
+{
+#ifdef _OPENMP
+	return (threads > 0)? threads : omp_get_max_threads();
+#else
+	return 1;
+#endif
 }
 
 
 bool
-QCT::readFilename(const char *filename, int headeronly,unsigned char *data)
+QCT::openFile(const char *filename)
 {
-	FILE *fp;
-	bool truth;
-
-	fp = fopen(filename, "rb");
-	if (fp == NULL)
+	if (!reader.open(filename, reader_mode))
 	{
 		throwError("cannot open %s (%s)", filename, strerror(errno));
 		return false;
 	}
-	truth = readFile(fp, headeronly,data);
-	fclose(fp);
-	return(truth);
+	debugmsg("Reading %s using %s", filename, QctReader::modeName(reader.mode()));
+
+	return readHeader();
+}
+
+
+/* -------------------------------------------------------------------------
+ * Decodes each tile in the current bounds with all Huffman decoders, checks
+ * that they agree and reports the average decoding time per tile.
+ */
+bool
+QCT::benchmarkTiles(int repeat)
+{
+	const QctReader::HuffmanDecoder methods[2] = { QctReader::HUFFMAN_BITWISE, QctReader::HUFFMAN_TABLE };
+	const char *method_names[2] = { "bitwise", "table" };
+	double total_time[2][2] = { {0,0},{0,0} };	// [huffman or not][method]
+	int num_tiles[2] = { 0,0 };
+	int num_mismatches = 0;
+	QctReader::Cursor c = reader.cursor(0);
+	unsigned char tile_data[2][QCT_TILE_PIXELS];
+
+	for (int yy=top_left_y; yy<top_left_y+size_y && yy<height; yy++)
+		for (int xx=top_left_x; xx<top_left_x+size_x && xx<width; xx++)
+		{
+			uint32_t tile_offset = tile_index[yy*width + xx];
+
+			c.seek(tile_offset);
+			int packing = c.peekByte();
+			int huffman = (packing == 0 || packing == 255);
+
+			for (int m=0; m<2; m++)
+			{
+				double start_time = current_time();
+
+				for (int r=0; r<repeat; r++)
+				{
+					c.seek(tile_offset);
+					QctReader::decodeTile(c, tile_data[m], QCT_TILE_SIZE, methods[m]);
+				}
+				total_time[huffman][m] += current_time() - start_time;
+			}
+			if (memcmp(tile_data[0], tile_data[1], QCT_TILE_PIXELS))
+			{
+				throwError("tile %d, %d decodes differently with %s and %s Huffman decoders", xx, yy, method_names[0], method_names[1]);
+				num_mismatches++;
+			}
+			num_tiles[huffman]++;
+		}
+
+	for (int huffman=1; huffman>=0; huffman--)
+	{
+		if (num_tiles[huffman] == 0)
+			continue;
+
+		fprintf(stderr, "%s tiles: %d\n", huffman?"Huffman":"RLE/pixel", num_tiles[huffman]);
+
+		for (int m=0; m<2; m++)
+			fprintf(stderr, "  %-8s %8.2f us/tile\n", method_names[m], 1e6 * total_time[huffman][m] / (num_tiles[huffman] * (double)repeat));
+
+		if (huffman && total_time[huffman][1] > 0)
+			fprintf(stderr, "  speedup  %8.2fx\n", total_time[huffman][0] / total_time[huffman][1]);
+	}
+	return num_mismatches == 0;
 }
 
 
@@ -1121,7 +900,17 @@ QCT::writeTIFFFilename(const char *filename)
 
 /* -------------------------------------------------------------------------
  */
-static bool writePNGFile(FILE *fp, const unsigned char *data, const int *palette, int W, int H)
+static const unsigned char *imageRow(int row, void *user)
+{
+	const ImageRows *rows = static_cast<const ImageRows*>(user);
+	return rows->data + rows->W * (size_t)row;
+}
+
+/* -------------------------------------------------------------------------
+ * Writes a paletted PNG one row at a time. Rows are requested in order from
+ * get_row(), so the whole image never needs to be in memory.
+ */
+static bool writePNGFile(FILE *fp, const int *palette, int W, int H, PNGRowCallback get_row, void *user)
 {
 #ifdef USE_PNG
 	int ii;
@@ -1159,14 +948,10 @@ static bool writePNGFile(FILE *fp, const unsigned char *data, const int *palette
 	}
 	png_set_PLTE(png_ptr, info_ptr, pal, num_palette);
 
-	png_byte *row_pointers[H];
+	png_write_info(png_ptr, info_ptr);
 
 	for (ii=0; ii<H; ii++)
-		row_pointers[ii]=static_cast<png_byte*>(const_cast<unsigned char *>(data + W*ii));
-
-	png_set_rows(png_ptr, info_ptr, row_pointers);
-
-	png_write_png(png_ptr, info_ptr, PNG_TRANSFORM_IDENTITY, NULL);
+		png_write_row(png_ptr, static_cast<png_const_bytep>(get_row(ii, user)));
 
 	png_write_end(png_ptr, info_ptr);
 	png_destroy_write_struct(&png_ptr, &info_ptr);
@@ -1180,6 +965,13 @@ static bool writePNGFile(FILE *fp, const unsigned char *data, const int *palette
 
 
 static bool writePNGFilename(const char *filename, const unsigned char *data, const int *palette, int W, int H)
+{
+	ImageRows rows = { data, W };
+	return writePNGFilename(filename, palette, W, H, imageRow, &rows);
+}
+
+
+static bool writePNGFilename(const char *filename, const int *palette, int W, int H, PNGRowCallback get_row, void *user)
 {
 	FILE *fp;
 	bool truth;
@@ -1188,7 +980,7 @@ static bool writePNGFilename(const char *filename, const unsigned char *data, co
 	if (fp == NULL)
 		throw std::runtime_error(std::string("cannot open ") + filename + " for writing.");
 
-	truth = writePNGFile(fp,data,palette,W,H);
+	truth = writePNGFile(fp,palette,W,H,get_row,user);
 
 	if (fclose(fp))
 		throw std::runtime_error(std::string("cannot write to file ") + filename + " (out of space?)");
@@ -1265,6 +1057,30 @@ int QCT::computeLatLonLimits(double& lat_00, double& lon_00,
     return true;
 }
 
+/* -------------------------------------------------------------------------
+ * Streamed output: tiles are decoded one row of tiles (a 64 pixels high band)
+ * at a time, just before libpng asks for the first pixel row of the band.
+ */
+struct BandRows
+{
+	const QCT *qct;
+	int x0, y0, nx;
+	unsigned char *band; // nx*64 x 64 pixels
+};
+
+static const unsigned char *bandRow(int row, void *user)
+{
+	BandRows *rows = static_cast<BandRows*>(user);
+	int W = rows->nx * QCT_TILE_SIZE;
+
+	if (row % QCT_TILE_SIZE == 0)
+	{
+		memset(rows->band, 0, W * QCT_TILE_SIZE);
+		rows->qct->decodeTiles(rows->x0, rows->y0 + row / QCT_TILE_SIZE, rows->nx, 1, rows->band);
+	}
+	return rows->band + W * (row % QCT_TILE_SIZE);
+}
+
 /* -------------------------------------------------------------------------
  * Test program.
  */
@@ -1272,11 +1088,16 @@ int
 main(int argc, char *argv[])
 {
 	char *prog;
-	const char *options = "dVqu:v:x:y:i:o:k:b:";
-	const char *usage = "usage: %s [-d] [-v] [-q] [-x SIZE] [-y SIZE] -i map.qct [-o map.png] [-k map.kmz]\n"
+	const char *options = "dVqtsu:v:x:y:i:o:k:b:r:B:j:";
+	const char *usage = "usage: %s [-d] [-v] [-q] [-t] [-s] [-B N] [-j N] [-r mmap|pread] [-x SIZE] [-y SIZE] -i map.qct [-o map.png] [-k map.kmz]\n"
 		"-d\tdebug\n"
 		"-V\tverbose\n"
 		"-q\tquery metadata only, no image extracted\n"
+		"-t\tprint decoding time\n"
+		"-s\tstream the png output, one row of tiles at a time (bounded memory)\n"
+		"-B\tbenchmark tile decoding, repeating each tile N times (no image extracted)\n"
+		"-r\tfile access method: mmap (default) or pread\n"
+		"-j\tnumber of decoding threads (default: one per core)\n"
 		"-u,v\tcoordinate of top left tile to start from (default: 0,0)\n"
 		"-x,y\tmaximum size of the output in tiles (0 means unlimited)\n"
 		"-i\tinput filename (qct format)\n"
@@ -1285,6 +1106,11 @@ main(int argc, char *argv[])
 	int debug = 0;
 	int verbose = 0;
 	int query = 0;
+	int timing = 0;
+	int streaming = 0;
+	int benchmark = 0;
+	int threads = 0;
+	QctReader::AccessMode reader_mode = QctReader::ACCESS_MMAP;
 	int top_left_tile_x=0,top_left_tile_y=0;
 	int size_tile_x=0,size_tile_y=0;
     int block_size=0;
@@ -1299,6 +1125,11 @@ main(int argc, char *argv[])
 		case 'd': debug++; break;
 		case 'V': verbose++; break;
 		case 'q': query++; break;
+		case 't': timing++; break;
+		case 's': streaming++; break;
+		case 'B': sscanf(optarg,"%d",&benchmark) ; break ;
+		case 'j': if(sscanf(optarg,"%d",&threads) != 1 || threads < 0) { fprintf(stderr, usage, prog); exit(1); } break;
+		case 'r': if(!QctReader::parseMode(optarg,reader_mode)) { fprintf(stderr, usage, prog); exit(1); } break;
 		case 'i': inputfile = optarg; break;
 		case 'o': outputfile = optarg; break;
 		case 'k': outputKMZfile = optarg; break;
@@ -1316,7 +1147,7 @@ main(int argc, char *argv[])
 		fprintf(stderr, usage, prog);
 		exit(1);
 	}
-	if (!query && !outputfile)
+	if (!query && !outputfile && !benchmark)
 	{
 		fprintf(stderr, "%s: missing -q or -o option\n", prog);
 		fprintf(stderr, usage, prog);
@@ -1326,15 +1157,24 @@ main(int argc, char *argv[])
 	QCT qct;
 	qct.setDebug(debug);
 	qct.setVerbose(verbose);
+	qct.setReaderMode(reader_mode);
+	qct.setThreads(threads);
 	qct.setBounds(top_left_tile_x,top_left_tile_y,size_tile_x,size_tile_y);
 
-    // read header so as to init tile size etc.
+    // read header and tile index once for all
 
-	qct.readFilename(inputfile,true,NULL) ;
+	if(!qct.openFile(inputfile))
+		return 1;
+
+	// unlimited sizes are resolved against the map size when reading the header
+	qct.getBounds(top_left_tile_x,top_left_tile_y,size_tile_x,size_tile_y);
 
     if(query)
         return 1;
 
+	if(benchmark)
+		return qct.benchmarkTiles(benchmark)? 0 : 1;
+
 	if(outputfile)
 		qct.message("Reading tiles (%d, %d) + %dx%d into image \"%s\"\n", top_left_tile_x,top_left_tile_y, size_tile_x,size_tile_y,outputfile);
 
@@ -1348,17 +1188,44 @@ main(int argc, char *argv[])
 		return 1;
 	}
 
-	unsigned char *image_data = (unsigned char*)calloc(size_tile_y*QCT_TILE_SIZE, size_tile_x*QCT_TILE_SIZE);
-
 	std::cerr << "Image size: " << size_tile_y*QCT_TILE_SIZE << " x " <<  size_tile_x*QCT_TILE_SIZE << std::endl;
-	if(!qct.readFilename(inputfile,query,image_data))
-		return 0;
 
-	writePNGFilename(outputfile,image_data,qct.getPalette(),size_tile_x*QCT_TILE_SIZE,size_tile_y*QCT_TILE_SIZE);
+	double start_time = current_time();
+
+	if(streaming)
+	{
+		// Only one row of tiles is kept in memory: tiles are decoded band by band while the png is written.
+
+		BandRows rows;
+		rows.qct  = &qct;
+		rows.x0   = top_left_tile_x;
+		rows.y0   = top_left_tile_y;
+		rows.nx   = size_tile_x;
+		rows.band = (unsigned char*)malloc(size_t(size_tile_x)*QCT_TILE_SIZE*QCT_TILE_SIZE);
+
+		writePNGFilename(outputfile,qct.getPalette(),size_tile_x*QCT_TILE_SIZE,size_tile_y*QCT_TILE_SIZE,bandRow,&rows);
+		free(rows.band);
+
+		if(timing)
+			fprintf(stderr, "Decoded and written %dx%d tiles in %.3f s (%s, %d threads, streamed)\n", size_tile_x, size_tile_y, current_time() - start_time, QctReader::modeName(reader_mode), qct.numThreads());
+	}
+	else
+	{
+		unsigned char *image_data = (unsigned char*)calloc(size_tile_y*QCT_TILE_SIZE, size_tile_x*QCT_TILE_SIZE);
+
+		qct.decodeTiles(image_data);
+
+		if(timing)
+			fprintf(stderr, "Decoded %dx%d tiles in %.3f s (%s, %d threads)\n", size_tile_x, size_tile_y, current_time() - start_time, QctReader::modeName(reader_mode), qct.numThreads());
+
+		writePNGFilename(outputfile,image_data,qct.getPalette(),size_tile_x*QCT_TILE_SIZE,size_tile_y*QCT_TILE_SIZE);
+		free(image_data);
+	}
 
 	if (outputKMZfile)
     {
         KmzFile kmz ;
+        std::vector<std::pair<int,int> > blocks ;	// top left tile of each block
 
         uint32_t block_index = 0 ;
 
@@ -1448,17 +1315,9 @@ main(int argc, char *argv[])
 				ld.west_limit  = 0.5*(lon_00+lon_01) ;
 #endif
 
-                // read image data
-
-				if(!qct.readFilename(inputfile,query,image_data))
-					return 0;
-
-                // save it into a proper png file
-
-                char output_template[100];
-                sprintf(output_template,"image_data_%04d.png",block_index);
+                // image data is extracted below, once all blocks are known
 
-				writePNGFilename(output_template,image_data,qct.getPalette(),block_size_x*QCT_TILE_SIZE,block_size_y*QCT_TILE_SIZE);
+				blocks.push_back(std::make_pair(top_left_tile_x + block_size_x*i,top_left_tile_y + block_size_y*j));
 
                 std::cerr << "Block " << block_index << " ("<< i << ","<< j << ") : [" << ld.south_limit << "," << ld.north_limit << "] x [" << ld.west_limit << "," << ld.east_limit << "]" << std::endl;
 #ifdef DEBUG
@@ -1470,7 +1329,36 @@ main(int argc, char *argv[])
                 ++block_index;
 			}
 
+        // Decode and save each block into a proper png file. The file was opened and indexed once for all,
+        // so blocks only cost the decoding of their own tiles, and are processed concurrently.
+
+        int failed_blocks = 0;
+
+#pragma omp parallel for schedule(dynamic) num_threads(qct.numThreads()) reduction(+:failed_blocks)
+        for(int b=0;b<(int)blocks.size();++b)
+        {
+            unsigned char *block_data = (unsigned char*)calloc(block_size_y*QCT_TILE_SIZE, block_size_x*QCT_TILE_SIZE);
+
+            char output_template[100];
+            sprintf(output_template,"image_data_%04d.png",b);
+
+            try
+            {
+                qct.decodeTiles(blocks[b].first,blocks[b].second,block_size_x,block_size_y,block_data);
+                writePNGFilename(output_template,block_data,qct.getPalette(),block_size_x*QCT_TILE_SIZE,block_size_y*QCT_TILE_SIZE);
+            }
+            catch(std::exception& e)
+            {
+                fprintf(stderr, "Block %d: %s\n", b, e.what());
+                ++failed_blocks;
+            }
+            free(block_data);
+        }
+
         kmz.writeToFile("doc.kml");
+
+        if(failed_blocks > 0)
+            return 1;
     }
 
 	return(0);